@@ -3,7 +3,58 @@
 #include <string.h>
 #include <stdio.h>
 #include "devices/ide.h"
+#include "devices/timer.h"
+#include "threads/interrupt.h"
 #include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+#include "threads/vaddr.h"
+
+/* Ticks a queued read or write may wait before the deadline
+   scheduler serves it ahead of the elevator order. */
+#define READ_DEADLINE 10
+#define WRITE_DEADLINE 50
+
+/* Most sectors moved by one transfer that merges several
+   requests. Also the most requests merged, since each has at
+   least one sector. */
+#define MERGE_MAX 16
+
+struct block_queue;
+
+/* An I/O scheduler. Picks which queued request the device
+   serves next. */
+struct block_scheduler
+  {
+    const char *name;                   /* Name for -iosched. */
+
+    /* Returns the request to serve next, without removing it.
+       The queue is not empty and its lock is held. */
+    struct block_request *(*next) (struct block_queue *);
+  };
+
+/* Requests waiting for a block device, and the thread that
+   hands them to its driver one batch at a time. */
+struct block_queue
+  {
+    struct lock lock;                   /* Guards all the members. */
+    struct condition not_empty;         /* Signaled when a request arrives. */
+    struct list sorted;                 /* Requests by sector. */
+    struct list fifo;                   /* Requests by arrival. */
+    block_sector_t head;                /* Sector just past the last one served. */
+    const struct block_scheduler *sched; /* Orders the requests. */
+    uint8_t *merge_buf;                 /* MERGE_MAX sectors that merged
+                                           requests are staged in. */
+
+    /* Statistics. */
+    size_t depth;                       /* Requests queued or in flight. */
+    size_t max_depth;                   /* Most ever queued or in flight. */
+    unsigned long long request_cnt;     /* Requests served. */
+    unsigned long long merge_cnt;       /* Served by another's transfer. */
+    int64_t total_latency;              /* Ticks from submission to completion. */
+    int64_t max_latency;                /* Longest single latency. */
+  };
 
 /* A block device. */
 struct block
@@ -19,6 +70,9 @@ struct block
 
     unsigned long long read_cnt;        /* Number of sectors read. */
     unsigned long long write_cnt;       /* Number of sectors written. */
+
+    struct block_queue *queue;          /* Request queue, or a null pointer
+                                           if requests go straight to OPS. */
   };
 
 /* List of all block devices. */
@@ -29,6 +83,36 @@ static struct block *block_by_role[BLOCK_ROLE_CNT];
 
 static struct block *list_elem_to_block (struct list_elem *);
 
+static struct block_request *clook_next (struct block_queue *);
+static struct block_request *deadline_next (struct block_queue *);
+
+/* Circular LOOK: serves requests in ascending sector order,
+   jumping back to the lowest one past the highest. */
+static const struct block_scheduler clook_scheduler =
+  { "clook", clook_next };
+
+/* C-LOOK, except that a request whose deadline has passed is
+   served first, so no request starves. */
+static const struct block_scheduler deadline_scheduler =
+  { "deadline", deadline_next };
+
+static const struct block_scheduler *schedulers[] =
+  { &clook_scheduler, &deadline_scheduler };
+
+/* Scheduler given to queues created from now on. */
+static const struct block_scheduler *default_scheduler = &deadline_scheduler;
+
+static void transfer (struct block *, bool write, block_sector_t,
+                      size_t cnt, void *);
+static bool use_queue (struct block *, const void *);
+static void queue_add (struct block *, struct block_request *);
+static void queue_submit (struct block *, bool write, block_sector_t,
+                          size_t cnt, void *);
+static void request_complete (struct block_request *);
+static void transfer_merged (struct block *, struct block_request **,
+                             size_t n);
+static void queue_dispatch (void *block_);
+
 /* Returns a human-readable name for the given block device
    TYPE. */
 const char *
@@ -121,10 +205,33 @@ void
 block_read (struct block *block, block_sector_t sector, void *buffer)
 {
   check_sector (block, sector);
-  block->ops->read (block->aux, sector, buffer);
+  if (use_queue (block, buffer))
+    queue_submit (block, false, sector, 1, buffer);
+  else
+    transfer (block, false, sector, 1, buffer);
   block->read_cnt++;
 }
 
+/* Reads the CNT consecutive sectors starting at SECTOR from
+   BLOCK into BUFFER, which must have room for
+   CNT * BLOCK_SECTOR_SIZE bytes.
+   Internally synchronizes accesses to block devices, so external
+   per-block device locking is unneeded. */
+void
+block_read_multiple (struct block *block, block_sector_t sector,
+                     size_t cnt, void *buffer)
+{
+  if (cnt == 0)
+    return;
+  check_sector (block, sector);
+  check_sector (block, sector + cnt - 1);
+  if (use_queue (block, buffer))
+    queue_submit (block, false, sector, cnt, buffer);
+  else
+    transfer (block, false, sector, cnt, buffer);
+  block->read_cnt += cnt;
+}
+
 /* Write sector SECTOR to BLOCK from BUFFER, which must contain
    BLOCK_SECTOR_SIZE bytes.  Returns after the block device has
    acknowledged receiving the data.
@@ -135,10 +242,90 @@ block_write (struct block *block, block_sector_t sector, const void *buffer)
 {
   check_sector (block, sector);
   ASSERT (block->type != BLOCK_FOREIGN);
-  block->ops->write (block->aux, sector, buffer);
+  if (use_queue (block, buffer))
+    queue_submit (block, true, sector, 1, (void *) buffer);
+  else
+    transfer (block, true, sector, 1, (void *) buffer);
   block->write_cnt++;
 }
 
+/* Writes the CNT consecutive sectors starting at SECTOR to BLOCK
+   from BUFFER, which must contain CNT * BLOCK_SECTOR_SIZE bytes.
+   Returns after the block device has acknowledged receiving the
+   data.
+   Internally synchronizes accesses to block devices, so external
+   per-block device locking is unneeded. */
+void
+block_write_multiple (struct block *block, block_sector_t sector,
+                      size_t cnt, const void *buffer)
+{
+  if (cnt == 0)
+    return;
+  check_sector (block, sector);
+  check_sector (block, sector + cnt - 1);
+  ASSERT (block->type != BLOCK_FOREIGN);
+  if (use_queue (block, buffer))
+    queue_submit (block, true, sector, cnt, (void *) buffer);
+  else
+    transfer (block, true, sector, cnt, (void *) buffer);
+  block->write_cnt += cnt;
+}
+
+/* Starts request R on BLOCK and returns without waiting for it
+   to complete.  Use block_poll() or block_wait() to find out when
+   it has, or R's DONE function to be told.  Several requests may
+   be in flight at once, and the device's queue orders them.
+   Must not be called from an interrupt handler. */
+void
+block_submit (struct block *block, struct block_request *r)
+{
+  ASSERT (!intr_context ());
+  ASSERT (r->cnt > 0);
+  ASSERT (is_kernel_vaddr (r->buffer));
+  check_sector (block, r->sector);
+  check_sector (block, r->sector + r->cnt - 1);
+  ASSERT (!r->write || block->type != BLOCK_FOREIGN);
+
+  r->completed = false;
+  sema_init (&r->sema, 0);
+  if (r->write)
+    block->write_cnt += r->cnt;
+  else
+    block->read_cnt += r->cnt;
+
+  if (block->queue != NULL)
+    queue_add (block, r);
+  else if (block->ops->submit != NULL)
+    block->ops->submit (block->aux, r);
+  else
+    {
+      transfer (block, r->write, r->sector, r->cnt, r->buffer);
+      request_complete (r);
+    }
+}
+
+/* Returns true if request R, passed to block_submit(), has
+   completed.  Does not wait. */
+bool
+block_poll (struct block_request *r)
+{
+  if (!r->completed && sema_try_down (&r->sema))
+    r->completed = true;
+  return r->completed;
+}
+
+/* Waits until request R, passed to block_submit(), has
+   completed. */
+void
+block_wait (struct block_request *r)
+{
+  if (!r->completed)
+    {
+      sema_down (&r->sema);
+      r->completed = true;
+    }
+}
+
 /* Returns the number of sectors in BLOCK. */
 block_sector_t
 block_size (struct block *block)
@@ -160,10 +347,12 @@ block_type (struct block *block)
   return block->type;
 }
 
-/* Prints statistics for each block device used for a Pintos role. */
+/* Prints statistics for each block device used for a Pintos role,
+   then for each request queue. */
 void
 block_print_stats (void)
 {
+  struct list_elem *e;
   int i;
 
   for (i = 0; i < BLOCK_ROLE_CNT; i++)
@@ -176,6 +365,55 @@ block_print_stats (void)
                   block->read_cnt, block->write_cnt);
         }
     }
+
+  for (e = list_begin (&all_blocks); e != list_end (&all_blocks);
+       e = list_next (e))
+    {
+      struct block *block = list_entry (e, struct block, list_elem);
+      struct block_queue *q = block->queue;
+      if (q != NULL)
+        {
+          lock_acquire (&q->lock);
+          printf ("%s queue (%s): %llu requests, %llu merged, "
+                  "max depth %zu, latency avg %lld max %lld ticks\n",
+                  block->name, q->sched->name, q->request_cnt, q->merge_cnt,
+                  q->max_depth,
+                  q->request_cnt > 0
+                  ? q->total_latency / (int64_t) q->request_cnt : 0,
+                  q->max_latency);
+          lock_release (&q->lock);
+        }
+    }
+}
+
+/* Makes NAME the I/O scheduler of every request queue, including
+   those created later.  Returns false if there is no scheduler
+   by that name. */
+bool
+block_set_scheduler (const char *name)
+{
+  struct list_elem *e;
+  size_t i;
+
+  for (i = 0; i < sizeof schedulers / sizeof *schedulers; i++)
+    if (!strcmp (schedulers[i]->name, name))
+      break;
+  if (i == sizeof schedulers / sizeof *schedulers)
+    return false;
+
+  default_scheduler = schedulers[i];
+  for (e = list_begin (&all_blocks); e != list_end (&all_blocks);
+       e = list_next (e))
+    {
+      struct block_queue *q = list_entry (e, struct block, list_elem)->queue;
+      if (q != NULL)
+        {
+          lock_acquire (&q->lock);
+          q->sched = default_scheduler;
+          lock_release (&q->lock);
+        }
+    }
+  return true;
 }
 
 /* Registers a new block device with the given NAME.  If
@@ -200,6 +438,7 @@ block_register (const char *name, enum block_type type,
   block->aux = aux;
   block->read_cnt = 0;
   block->write_cnt = 0;
+  block->queue = NULL;
 
   printf ("%s: %'"PRDSNu" sectors (", block->name, block->size);
   print_human_readable_size ((uint64_t) block->size * BLOCK_SECTOR_SIZE);
@@ -211,6 +450,276 @@ block_register (const char *name, enum block_type type,
   return block;
 }
 
+/* Gives BLOCK a request queue, so that requests from different
+   threads reach its driver in an order that keeps seeks short.
+   Called by drivers of devices with a seek cost, once the thread
+   system is running.  Until then requests go straight to the
+   driver, as do requests for devices without a queue (such as
+   partitions, whose requests end up in their disk's queue). */
+void
+block_enable_queue (struct block *block)
+{
+  struct block_queue *q;
+  char name[sizeof block->name + 3];
+
+  ASSERT (block->queue == NULL);
+
+  q = malloc (sizeof *q);
+  if (q == NULL)
+    PANIC ("Failed to allocate memory for block device queue");
+  lock_init (&q->lock);
+  cond_init (&q->not_empty);
+  list_init (&q->sorted);
+  list_init (&q->fifo);
+  q->head = 0;
+  q->sched = default_scheduler;
+  q->merge_buf = palloc_get_multiple (PAL_ASSERT,
+                                      MERGE_MAX * BLOCK_SECTOR_SIZE / PGSIZE);
+  q->depth = q->max_depth = 0;
+  q->request_cnt = q->merge_cnt = 0;
+  q->total_latency = q->max_latency = 0;
+
+  /* Requests submitted before the dispatcher first runs just
+     wait in the queue. */
+  block->queue = q;
+  snprintf (name, sizeof name, "%s-io", block->name);
+  if (thread_create (name, PRI_MAX, queue_dispatch, block) == TID_ERROR)
+    PANIC ("Failed to start block device dispatcher");
+}
+
+/* Returns true if a transfer between BLOCK and BUFFER goes
+   through BLOCK's queue.  Not if BLOCK has none, not from an
+   interrupt handler, which may not sleep, and not for a user
+   BUFFER, which only the current thread's page directory maps
+   while the dispatcher runs with its own. */
+static bool
+use_queue (struct block *block, const void *buffer)
+{
+  return block->queue != NULL && !intr_context () && is_kernel_vaddr (buffer);
+}
+
+/* Returns true if request A_ starts at a lower sector than B_. */
+static bool
+request_less (const struct list_elem *a_, const struct list_elem *b_,
+              void *aux UNUSED)
+{
+  const struct block_request *a
+    = list_entry (a_, struct block_request, sorted_elem);
+  const struct block_request *b
+    = list_entry (b_, struct block_request, sorted_elem);
+  return a->sector < b->sector;
+}
+
+/* Adds request R to BLOCK's queue, for the dispatcher to serve. */
+static void
+queue_add (struct block *block, struct block_request *r)
+{
+  struct block_queue *q = block->queue;
+
+  r->queued = timer_ticks ();
+  r->deadline = r->queued + (r->write ? WRITE_DEADLINE : READ_DEADLINE);
+
+  lock_acquire (&q->lock);
+  list_insert_ordered (&q->sorted, &r->sorted_elem, request_less, NULL);
+  list_push_back (&q->fifo, &r->fifo_elem);
+  if (++q->depth > q->max_depth)
+    q->max_depth = q->depth;
+  cond_signal (&q->not_empty, &q->lock);
+  lock_release (&q->lock);
+}
+
+/* Queues a transfer of CNT sectors between SECTOR on BLOCK and
+   BUFFER, then waits until it has been served. */
+static void
+queue_submit (struct block *block, bool write, block_sector_t sector,
+              size_t cnt, void *buffer)
+{
+  struct block_request r;
+
+  r.write = write;
+  r.sector = sector;
+  r.cnt = cnt;
+  r.buffer = buffer;
+  r.done = NULL;
+  r.completed = false;
+  sema_init (&r.sema, 0);
+  queue_add (block, &r);
+  block_wait (&r);
+}
+
+/* Marks request R served: calls its DONE function, then wakes
+   whoever waits for it.  R may be gone once this returns. */
+static void
+request_complete (struct block_request *r)
+{
+  if (r->done != NULL)
+    r->done (r, r->aux);
+  sema_up (&r->sema);
+}
+
+/* Has BLOCK's driver transfer CNT sectors between SECTOR and
+   BUFFER, with a single call if the driver can. */
+static void
+transfer (struct block *block, bool write, block_sector_t sector,
+          size_t cnt, void *buffer)
+{
+  const struct block_operations *ops = block->ops;
+  uint8_t *p = buffer;
+  size_t i;
+
+  if (cnt > 1 && write && ops->write_multiple != NULL)
+    ops->write_multiple (block->aux, sector, cnt, buffer);
+  else if (cnt > 1 && !write && ops->read_multiple != NULL)
+    ops->read_multiple (block->aux, sector, cnt, buffer);
+  else
+    for (i = 0; i < cnt; i++)
+      if (write)
+        ops->write (block->aux, sector + i, p + i * BLOCK_SECTOR_SIZE);
+      else
+        ops->read (block->aux, sector + i, p + i * BLOCK_SECTOR_SIZE);
+}
+
+/* Has BLOCK's driver serve the N requests in BATCH, which follow
+   each other on disk and go in the same direction, with a single
+   transfer.  Unless their buffers follow each other in memory
+   too, the data passes through the queue's merge buffer. */
+static void
+transfer_merged (struct block *block, struct block_request **batch, size_t n)
+{
+  struct block_request *first = batch[0];
+  struct block_request *last = batch[n - 1];
+  size_t cnt = last->sector + last->cnt - first->sector;
+  uint8_t *buf = block->queue->merge_buf;
+  uint8_t *p;
+  size_t i;
+
+  for (i = 1; i < n; i++)
+    if ((uint8_t *) batch[i]->buffer
+        != (uint8_t *) batch[i - 1]->buffer
+           + batch[i - 1]->cnt * BLOCK_SECTOR_SIZE)
+      break;
+  if (i == n)
+    {
+      transfer (block, first->write, first->sector, cnt, first->buffer);
+      return;
+    }
+
+  ASSERT (cnt <= MERGE_MAX);
+  if (first->write)
+    for (i = 0, p = buf; i < n; p += batch[i++]->cnt * BLOCK_SECTOR_SIZE)
+      memcpy (p, batch[i]->buffer, batch[i]->cnt * BLOCK_SECTOR_SIZE);
+  transfer (block, first->write, first->sector, cnt, buf);
+  if (!first->write)
+    for (i = 0, p = buf; i < n; p += batch[i++]->cnt * BLOCK_SECTOR_SIZE)
+      memcpy (batch[i]->buffer, p, batch[i]->cnt * BLOCK_SECTOR_SIZE);
+}
+
+/* Dispatcher thread for the block device BLOCK_.  Takes the
+   request its queue's scheduler picks, together with the queued
+   requests that continue it on disk, and serves them with one
+   transfer, as soon as the device is done with the previous
+   one. */
+static void
+queue_dispatch (void *block_)
+{
+  struct block *block = block_;
+  struct block_queue *q = block->queue;
+  struct block_request *batch[MERGE_MAX];
+  size_t n, i, cnt;
+
+  for (;;)
+    {
+      struct list_elem *e;
+      int64_t now;
+
+      lock_acquire (&q->lock);
+      while (list_empty (&q->sorted))
+        cond_wait (&q->not_empty, &q->lock);
+
+      /* Merge the following requests in the same direction
+         for as long as each starts where the last one ends and
+         they fit in the merge buffer together. */
+      batch[0] = q->sched->next (q);
+      n = 1;
+      cnt = batch[0]->cnt;
+      for (e = list_next (&batch[0]->sorted_elem);
+           e != list_end (&q->sorted); e = list_next (e))
+        {
+          struct block_request *r
+            = list_entry (e, struct block_request, sorted_elem);
+          struct block_request *last = batch[n - 1];
+          if (r->write != last->write || r->sector != last->sector + last->cnt
+              || cnt + r->cnt > MERGE_MAX)
+            break;
+          batch[n++] = r;
+          cnt += r->cnt;
+        }
+      for (i = 0; i < n; i++)
+        {
+          list_remove (&batch[i]->sorted_elem);
+          list_remove (&batch[i]->fifo_elem);
+        }
+      q->head = batch[n - 1]->sector + batch[n - 1]->cnt;
+      lock_release (&q->lock);
+
+      if (n == 1)
+        transfer (block, batch[0]->write, batch[0]->sector, batch[0]->cnt,
+                  batch[0]->buffer);
+      else
+        transfer_merged (block, batch, n);
+
+      now = timer_ticks ();
+      lock_acquire (&q->lock);
+      q->depth -= n;
+      q->request_cnt += n;
+      q->merge_cnt += n - 1;
+      for (i = 0; i < n; i++)
+        {
+          int64_t latency = now - batch[i]->queued;
+          q->total_latency += latency;
+          if (latency > q->max_latency)
+            q->max_latency = latency;
+        }
+      lock_release (&q->lock);
+
+      for (i = 0; i < n; i++)
+        request_complete (batch[i]);
+    }
+}
+
+/* Returns the first request at or past Q's head, or the lowest
+   one if the head has passed them all. */
+static struct block_request *
+clook_next (struct block_queue *q)
+{
+  struct list_elem *e;
+
+  for (e = list_begin (&q->sorted); e != list_end (&q->sorted);
+       e = list_next (e))
+    {
+      struct block_request *r
+        = list_entry (e, struct block_request, sorted_elem);
+      if (r->sector >= q->head)
+        return r;
+    }
+  return list_entry (list_front (&q->sorted), struct block_request,
+                     sorted_elem);
+}
+
+/* Returns Q's oldest request if its deadline has passed, and
+   otherwise the one C-LOOK picks.  Serving the oldest moves the
+   head, so C-LOOK carries on from there. */
+static struct block_request *
+deadline_next (struct block_queue *q)
+{
+  struct block_request *oldest
+    = list_entry (list_front (&q->fifo), struct block_request, fifo_elem);
+
+  if (timer_ticks () >= oldest->deadline)
+    return oldest;
+  return clook_next (q);
+}
+
 /* Returns the block device corresponding to LIST_ELEM, or a null
    pointer if LIST_ELEM is the list end of all_blocks. */
 static struct block *
@@ -1,8 +1,11 @@
 #ifndef DEVICES_BLOCK_H
 #define DEVICES_BLOCK_H
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <inttypes.h>
+#include <list.h>
+#include "threads/synch.h"
 
 /* Size of a block device sector in bytes.
    All IDE disks use this sector size, as do most USB and SCSI
@@ -52,12 +55,54 @@ struct block *block_next (struct block *);
 /* Block device operations. */
 block_sector_t block_size (struct block *);
 void block_read (struct block *, block_sector_t, void *);
+void block_read_multiple (struct block *, block_sector_t, size_t, void *);
 void block_write (struct block *, block_sector_t, const void *);
+void block_write_multiple (struct block *, block_sector_t, size_t,
+                           const void *);
 const char *block_name (struct block *);
 enum block_type block_type (struct block *);
 
+/* Asynchronous requests. */
+
+struct block_request;
+
+/* Called when request R completes, with the AUX it was submitted
+   with.  Runs in the thread that serves the device, so it must not
+   wait for another transfer on that device. */
+typedef void block_done_func (struct block_request *r, void *aux);
+
+/* A transfer submitted with block_submit().  The submitter sets
+   the members up to AUX, and must not touch the request or its
+   buffer again until it completes.  A partition changes SECTOR
+   into its disk's numbering as it passes the request on. */
+struct block_request
+  {
+    bool write;                         /* Write, not read? */
+    block_sector_t sector;              /* First sector. */
+    size_t cnt;                         /* Number of consecutive sectors. */
+    void *buffer;                       /* CNT * BLOCK_SECTOR_SIZE bytes,
+                                           in kernel memory. */
+    block_done_func *done;              /* Called on completion, or null. */
+    void *aux;                          /* Passed to DONE. */
+
+    /* Owned by the block layer. */
+    struct list_elem sorted_elem;       /* Element in queue's sorted list. */
+    struct list_elem fifo_elem;         /* Element in queue's fifo list. */
+    int64_t queued;                     /* Tick when it was submitted. */
+    int64_t deadline;                   /* Tick it should be served by. */
+    bool completed;                     /* Seen complete by the submitter? */
+    struct semaphore sema;              /* Upped once it is served. */
+  };
+
+void block_submit (struct block *, struct block_request *);
+bool block_poll (struct block_request *);
+void block_wait (struct block_request *);
+
 /* Statistics. */
 void block_print_stats (void);
+
+/* I/O scheduling. */
+bool block_set_scheduler (const char *name);
 
 /* Lower-level interface to block device drivers. */
 
@@ -65,10 +110,23 @@ struct block_operations
   {
     void (*read) (void *aux, block_sector_t, void *buffer);
     void (*write) (void *aux, block_sector_t, const void *buffer);
+
+    /* Transfer CNT consecutive sectors at once.  Optional: if
+       null, READ or WRITE is called once per sector. */
+    void (*read_multiple) (void *aux, block_sector_t, size_t cnt,
+                           void *buffer);
+    void (*write_multiple) (void *aux, block_sector_t, size_t cnt,
+                            const void *buffer);
+
+    /* Passes request R on to another device, without waiting for
+       it.  Optional: if null and the device has no queue, R is
+       served before block_submit() returns. */
+    void (*submit) (void *aux, struct block_request *r);
   };
 
 struct block *block_register (const char *name, enum block_type,
                               const char *extra_info, block_sector_t size,
                               const struct block_operations *, void *aux);
+void block_enable_queue (struct block *);
 
 #endif /* devices/block.h */
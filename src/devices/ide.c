@@ -3,12 +3,15 @@
 #include <debug.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <string.h>
 #include "devices/block.h"
 #include "devices/partition.h"
+#include "devices/pci.h"
 #include "devices/timer.h"
 #include "threads/io.h"
 #include "threads/interrupt.h"
 #include "threads/synch.h"
+#include "threads/vaddr.h"
 
 /* The code in this file is an interface to an ATA (IDE)
    controller.  It attempts to comply to [ATA-3]. */
@@ -30,10 +33,25 @@
 #define reg_ctl(CHANNEL) ((CHANNEL)->reg_base + 0x206)  /* Control (w/o). */
 #define reg_alt_status(CHANNEL) reg_ctl (CHANNEL)       /* Alt Status (r/o). */
 
+/* Bus master IDE port addresses, one set per channel.  See
+   [PIIX] for details. */
+#define bm_command(CHANNEL) ((CHANNEL)->bm_base + 0)    /* Command. */
+#define bm_status(CHANNEL) ((CHANNEL)->bm_base + 2)     /* Status. */
+#define bm_prdt(CHANNEL) ((CHANNEL)->bm_base + 4)       /* PRD table address. */
+
+/* Bus master Command Register bits. */
+#define BM_CMD_START 0x01       /* Start transfer. */
+#define BM_CMD_READ 0x08        /* Transfer from disk to memory. */
+
+/* Bus master Status Register bits.  Writing 1 clears ERR and IRQ. */
+#define BM_STA_ERR 0x02         /* Transfer failed. */
+#define BM_STA_IRQ 0x04         /* Disk raised its interrupt. */
+
 /* Alternate Status Register bits. */
 #define STA_BSY 0x80            /* Busy. */
 #define STA_DRDY 0x40           /* Device Ready. */
 #define STA_DRQ 0x08            /* Data Request. */
+#define STA_ERR 0x01            /* Error. */
 
 /* Control Register bits. */
 #define CTL_SRST 0x04           /* Software Reset. */
@@ -49,6 +67,15 @@
 #define CMD_IDENTIFY_DEVICE 0xec        /* IDENTIFY DEVICE. */
 #define CMD_READ_SECTOR_RETRY 0x20      /* READ SECTOR with retries. */
 #define CMD_WRITE_SECTOR_RETRY 0x30     /* WRITE SECTOR with retries. */
+#define CMD_READ_MULTIPLE 0xc4          /* READ MULTIPLE. */
+#define CMD_WRITE_MULTIPLE 0xc5         /* WRITE MULTIPLE. */
+#define CMD_SET_MULTIPLE_MODE 0xc6      /* SET MULTIPLE MODE. */
+#define CMD_READ_DMA 0xc8               /* READ DMA. */
+#define CMD_WRITE_DMA 0xca              /* WRITE DMA. */
+
+/* Most sectors one command transfers.  The Sector Count register
+   holds 0 for this many. */
+#define MAX_COMMAND_SECTORS 256
 
 /* An ATA device. */
 struct ata_disk
@@ -57,8 +84,28 @@ struct ata_disk
     struct channel *channel;    /* Channel that disk is attached to. */
     int dev_no;                 /* Device 0 or 1 for master or slave. */
     bool is_ata;                /* Is device an ATA disk? */
+    size_t multiple;            /* Sectors per interrupt with READ/WRITE
+                                   MULTIPLE, 0 if they are not used. */
+    bool dma;                   /* Does the disk do DMA transfers? */
+  };
+
+/* A Physical Region Descriptor: a piece of memory a bus master
+   transfer reads or writes.  The piece may not cross a 64 kB
+   boundary. */
+struct prd
+  {
+    uint32_t addr;              /* Physical address. */
+    uint16_t size;              /* Bytes, 0 for 64 kB. */
+    uint16_t flags;             /* PRD_EOT on the last descriptor. */
   };
 
+#define PRD_EOT 0x8000          /* End of table. */
+
+/* Descriptors one transfer needs at most.  Its buffer is
+   physically contiguous, and no larger than 128 kB, so it spans
+   at most 3 pieces. */
+#define PRD_CNT 4
+
 /* An ATA channel (aka controller).
    Each channel can control up to two disks. */
 struct channel
@@ -72,6 +119,10 @@ struct channel
                                    any interrupt would be spurious. */
     struct semaphore completion_wait;   /* Up'd by interrupt handler. */
 
+    uint16_t bm_base;           /* Bus master I/O port base, 0 if none. */
+    struct prd prdt[PRD_CNT]    /* Descriptors for the DMA transfer. */
+      __attribute__ ((aligned (sizeof (struct prd) * PRD_CNT)));
+
     struct ata_disk devices[2];     /* The devices on this channel. */
   };
 
@@ -81,14 +132,23 @@ static struct channel channels[CHANNEL_CNT];
 
 static struct block_operations ide_operations;
 
+static uint16_t find_bus_master (void);
 static void reset_channel (struct channel *);
 static bool check_device_type (struct ata_disk *);
 static void identify_ata_device (struct ata_disk *);
+static void set_multiple_mode (struct ata_disk *, size_t);
 
-static void select_sector (struct ata_disk *, block_sector_t);
+static void select_sector (struct ata_disk *, block_sector_t, size_t cnt);
 static void issue_pio_command (struct channel *, uint8_t command);
 static void input_sector (struct channel *, void *);
 static void output_sector (struct channel *, const void *);
+static void pio_read (struct ata_disk *, block_sector_t, size_t cnt,
+                      uint8_t *);
+static void pio_write (struct ata_disk *, block_sector_t, size_t cnt,
+                       const uint8_t *);
+static bool dma_usable (const struct ata_disk *, const void *);
+static void dma_transfer (struct ata_disk *, block_sector_t, size_t cnt,
+                          void *, bool write);
 
 static void wait_until_idle (const struct ata_disk *);
 static bool wait_while_busy (const struct ata_disk *);
@@ -101,6 +161,7 @@ static void interrupt_handler (struct intr_frame *);
 void
 ide_init (void) 
 {
+  uint16_t bm_base = find_bus_master ();
   size_t chan_no;
 
   for (chan_no = 0; chan_no < CHANNEL_CNT; chan_no++)
@@ -126,6 +187,7 @@ ide_init (void)
       lock_init (&c->lock);
       c->expecting_interrupt = false;
       sema_init (&c->completion_wait, 0);
+      c->bm_base = bm_base != 0 ? bm_base + chan_no * 8 : 0;
  
       /* Initialize devices. */
       for (dev_no = 0; dev_no < 2; dev_no++)
@@ -136,6 +198,8 @@ ide_init (void)
           d->channel = c;
           d->dev_no = dev_no;
           d->is_ata = false;
+          d->multiple = 0;
+          d->dma = false;
         }
 
       /* Register interrupt handler. */
@@ -157,6 +221,35 @@ ide_init (void)
 
 /* Disk detection and identification. */
 
+/* Looks for a PCI IDE controller that drives the legacy channels
+   and can act as bus master.  If there is one, lets it master the
+   bus and returns the base of its bus master I/O ports.  Returns
+   0 otherwise, and all transfers use PIO. */
+static uint16_t
+find_bus_master (void)
+{
+  struct pci_func f;
+  uint32_t class_reg, bar;
+
+  if (!pci_find_class (0x01, 0x01, &f))
+    return 0;
+
+  /* Prog-if bit 7: bus master capable.
+     Bits 0 and 2: a channel in native mode, at other ports. */
+  class_reg = pci_read_config (&f, PCI_REG_CLASS);
+  if (!(class_reg & 0x8000) || (class_reg & 0x0500))
+    return 0;
+
+  bar = pci_read_config (&f, PCI_REG_BAR (4));
+  if (!(bar & PCI_BAR_IO) || (bar & ~3u) == 0)
+    return 0;
+
+  pci_write_config (&f, PCI_REG_COMMAND,
+                    (pci_read_config (&f, PCI_REG_COMMAND) & 0xffff)
+                    | PCI_CMD_IO | PCI_CMD_MASTER);
+  return bar & ~3u;
+}
+
 static char *descramble_ata_string (char *, int size);
 
 /* Resets an ATA channel and waits for any devices present on it
@@ -303,10 +396,20 @@ identify_ata_device (struct ata_disk *d)
       return;
     }
 
+  /* Word 47 gives the most sectors READ/WRITE MULTIPLE can move
+     per interrupt, 0 or 1 if they are not worth using. */
+  set_multiple_mode (d, (uint8_t) id[47 * 2]);
+
+  /* Word 49 bit 8: DMA supported. */
+  d->dma = d->channel->bm_base != 0 && (id[49 * 2 + 1] & 0x01) != 0;
+  if (d->dma)
+    strlcat (extra_info, ", DMA", sizeof extra_info);
+
   /* Register. */
   block = block_register (d->name, BLOCK_RAW, extra_info, capacity,
                           &ide_operations, d);
   partition_scan (block);
+  block_enable_queue (block);
 }
 
 /* Translates STRING, which consists of SIZE bytes in a funky
@@ -337,63 +440,128 @@ descramble_ata_string (char *string, int size)
   return string;
 }
 
-/* Reads sector SEC_NO from disk D into BUFFER, which must have
-   room for BLOCK_SECTOR_SIZE bytes.
+/* Makes disk D move up to CNT sectors per interrupt with READ
+   MULTIPLE and WRITE MULTIPLE, if CNT is more than 1 and D accepts
+   it. */
+static void
+set_multiple_mode (struct ata_disk *d, size_t cnt)
+{
+  struct channel *c = d->channel;
+
+  if (cnt <= 1)
+    return;
+
+  select_device_wait (d);
+  outb (reg_nsect (c), cnt);
+  issue_pio_command (c, CMD_SET_MULTIPLE_MODE);
+  sema_down (&c->completion_wait);
+  wait_while_busy (d);
+  if (!(inb (reg_alt_status (c)) & STA_ERR))
+    d->multiple = cnt;
+}
+
+/* Reads the CNT sectors starting at SEC_NO from disk D into
+   BUFFER, which must have room for CNT * BLOCK_SECTOR_SIZE bytes.
+   Each command moves up to MAX_COMMAND_SECTORS, by DMA if D and
+   BUFFER allow it and by PIO otherwise.
    Internally synchronizes accesses to disks, so external
    per-disk locking is unneeded. */
 static void
-ide_read (void *d_, block_sector_t sec_no, void *buffer)
+ide_read_multiple (void *d_, block_sector_t sec_no, size_t cnt, void *buffer)
 {
   struct ata_disk *d = d_;
   struct channel *c = d->channel;
+  uint8_t *p = buffer;
+
   lock_acquire (&c->lock);
-  select_sector (d, sec_no);
-  issue_pio_command (c, CMD_READ_SECTOR_RETRY);
-  sema_down (&c->completion_wait);
-  if (!wait_while_busy (d))
-    PANIC ("%s: disk read failed, sector=%"PRDSNu, d->name, sec_no);
-  input_sector (c, buffer);
+  while (cnt > 0)
+    {
+      size_t n = cnt < MAX_COMMAND_SECTORS ? cnt : MAX_COMMAND_SECTORS;
+      if (dma_usable (d, p))
+        dma_transfer (d, sec_no, n, p, false);
+      else
+        pio_read (d, sec_no, n, p);
+      p += n * BLOCK_SECTOR_SIZE;
+      sec_no += n;
+      cnt -= n;
+    }
   lock_release (&c->lock);
 }
 
-/* Write sector SEC_NO to disk D from BUFFER, which must contain
-   BLOCK_SECTOR_SIZE bytes.  Returns after the disk has
-   acknowledged receiving the data.
+/* Writes the CNT sectors starting at SEC_NO to disk D from
+   BUFFER, which must contain CNT * BLOCK_SECTOR_SIZE bytes.
+   Returns after the disk has acknowledged receiving the data.
+   Each command moves up to MAX_COMMAND_SECTORS, by DMA if D and
+   BUFFER allow it and by PIO otherwise.
    Internally synchronizes accesses to disks, so external
    per-disk locking is unneeded. */
 static void
-ide_write (void *d_, block_sector_t sec_no, const void *buffer)
+ide_write_multiple (void *d_, block_sector_t sec_no, size_t cnt,
+                    const void *buffer)
 {
   struct ata_disk *d = d_;
   struct channel *c = d->channel;
+  const uint8_t *p = buffer;
+
   lock_acquire (&c->lock);
-  select_sector (d, sec_no);
-  issue_pio_command (c, CMD_WRITE_SECTOR_RETRY);
-  if (!wait_while_busy (d))
-    PANIC ("%s: disk write failed, sector=%"PRDSNu, d->name, sec_no);
-  output_sector (c, buffer);
-  sema_down (&c->completion_wait);
+  while (cnt > 0)
+    {
+      size_t n = cnt < MAX_COMMAND_SECTORS ? cnt : MAX_COMMAND_SECTORS;
+      if (dma_usable (d, p))
+        dma_transfer (d, sec_no, n, (void *) p, true);
+      else
+        pio_write (d, sec_no, n, p);
+      p += n * BLOCK_SECTOR_SIZE;
+      sec_no += n;
+      cnt -= n;
+    }
   lock_release (&c->lock);
 }
 
+/* Reads sector SEC_NO from disk D into BUFFER, which must have
+   room for BLOCK_SECTOR_SIZE bytes.
+   Internally synchronizes accesses to disks, so external
+   per-disk locking is unneeded. */
+static void
+ide_read (void *d_, block_sector_t sec_no, void *buffer)
+{
+  ide_read_multiple (d_, sec_no, 1, buffer);
+}
+
+/* Write sector SEC_NO to disk D from BUFFER, which must contain
+   BLOCK_SECTOR_SIZE bytes.  Returns after the disk has
+   acknowledged receiving the data.
+   Internally synchronizes accesses to disks, so external
+   per-disk locking is unneeded. */
+static void
+ide_write (void *d_, block_sector_t sec_no, const void *buffer)
+{
+  ide_write_multiple (d_, sec_no, 1, buffer);
+}
+
 static struct block_operations ide_operations =
   {
     ide_read,
-    ide_write
+    ide_write,
+    ide_read_multiple,
+    ide_write_multiple,
+    NULL
   };
-
+
 /* Selects device D, waiting for it to become ready, and then
-   writes SEC_NO to the disk's sector selection registers.  (We
-   use LBA mode.) */
+   writes SEC_NO and the count CNT, which may be up to
+   MAX_COMMAND_SECTORS, to the disk's sector selection registers.
+   (We use LBA mode.) */
 static void
-select_sector (struct ata_disk *d, block_sector_t sec_no)
+select_sector (struct ata_disk *d, block_sector_t sec_no, size_t cnt)
 {
   struct channel *c = d->channel;
 
-  ASSERT (sec_no < (1UL << 28));
+  ASSERT (sec_no + cnt <= (1UL << 28));
+  ASSERT (cnt > 0 && cnt <= MAX_COMMAND_SECTORS);
   
   select_device_wait (d);
-  outb (reg_nsect (c), 1);
+  outb (reg_nsect (c), cnt % MAX_COMMAND_SECTORS);
   outb (reg_lbal (c), sec_no);
   outb (reg_lbam (c), sec_no >> 8);
   outb (reg_lbah (c), (sec_no >> 16));
@@ -430,6 +598,119 @@ output_sector (struct channel *c, const void *sector)
   outsw (reg_data (c), sector, BLOCK_SECTOR_SIZE / 2);
 }
 
+/* Reads CNT sectors, at most MAX_COMMAND_SECTORS, starting at
+   SEC_NO from disk D into P by PIO, with an interrupt per sector,
+   or per D->multiple sectors with READ MULTIPLE.
+   D's channel must be locked. */
+static void
+pio_read (struct ata_disk *d, block_sector_t sec_no, size_t cnt, uint8_t *p)
+{
+  struct channel *c = d->channel;
+  size_t per_irq = d->multiple > 0 ? d->multiple : 1;
+  size_t i;
+
+  select_sector (d, sec_no, cnt);
+  issue_pio_command (c, (d->multiple > 0 ? CMD_READ_MULTIPLE
+                         : CMD_READ_SECTOR_RETRY));
+  for (i = 0; i < cnt; i++)
+    {
+      if (i % per_irq == 0)
+        {
+          sema_down (&c->completion_wait);
+          if (!wait_while_busy (d))
+            PANIC ("%s: disk read failed, sector=%"PRDSNu,
+                   d->name, sec_no + i);
+        }
+      input_sector (c, p);
+      p += BLOCK_SECTOR_SIZE;
+    }
+}
+
+/* Writes CNT sectors, at most MAX_COMMAND_SECTORS, starting at
+   SEC_NO to disk D from P by PIO, with an interrupt per sector,
+   or per D->multiple sectors with WRITE MULTIPLE.
+   D's channel must be locked. */
+static void
+pio_write (struct ata_disk *d, block_sector_t sec_no, size_t cnt,
+           const uint8_t *p)
+{
+  struct channel *c = d->channel;
+  size_t per_irq = d->multiple > 0 ? d->multiple : 1;
+  size_t i;
+
+  select_sector (d, sec_no, cnt);
+  issue_pio_command (c, (d->multiple > 0 ? CMD_WRITE_MULTIPLE
+                         : CMD_WRITE_SECTOR_RETRY));
+  for (i = 0; i < cnt; i++)
+    {
+      /* The disk asks for the first block of data right away,
+         and interrupts once it has taken each one. */
+      if (i % per_irq == 0 && !wait_while_busy (d))
+        PANIC ("%s: disk write failed, sector=%"PRDSNu, d->name, sec_no + i);
+      output_sector (c, p);
+      p += BLOCK_SECTOR_SIZE;
+      if ((i + 1) % per_irq == 0 || i + 1 == cnt)
+        sema_down (&c->completion_wait);
+    }
+}
+
+/* Returns true if BUFFER can be transferred to or from disk D by
+   DMA.  The buffer must be kernel memory, which is physically
+   contiguous, and word aligned. */
+static bool
+dma_usable (const struct ata_disk *d, const void *buffer)
+{
+  return d->dma && is_kernel_vaddr (buffer) && ((uintptr_t) buffer & 1) == 0;
+}
+
+/* Transfers CNT sectors, at most MAX_COMMAND_SECTORS, between
+   SEC_NO on disk D and BUFFER, to the disk if WRITE is true and
+   from it otherwise.  The channel's bus master moves the data
+   while the CPU runs other threads; one interrupt signals the
+   end.  D's channel must be locked. */
+static void
+dma_transfer (struct ata_disk *d, block_sector_t sec_no, size_t cnt,
+              void *buffer, bool write)
+{
+  struct channel *c = d->channel;
+  uintptr_t addr = vtop (buffer);
+  size_t left = cnt * BLOCK_SECTOR_SIZE;
+  size_t prd_cnt = 0;
+  uint8_t status;
+
+  /* Describe BUFFER in pieces that do not cross 64 kB. */
+  while (left > 0)
+    {
+      size_t room = 0x10000 - (addr & 0xffff);
+      size_t size = left < room ? left : room;
+
+      ASSERT (prd_cnt < PRD_CNT);
+      c->prdt[prd_cnt].addr = addr;
+      c->prdt[prd_cnt].size = size & 0xffff;
+      c->prdt[prd_cnt].flags = 0;
+      prd_cnt++;
+      addr += size;
+      left -= size;
+    }
+  c->prdt[prd_cnt - 1].flags = PRD_EOT;
+
+  outl (bm_prdt (c), vtop (c->prdt));
+  outb (bm_command (c), write ? 0 : BM_CMD_READ);
+  outb (bm_status (c), inb (bm_status (c)) | BM_STA_ERR | BM_STA_IRQ);
+
+  select_sector (d, sec_no, cnt);
+  issue_pio_command (c, write ? CMD_WRITE_DMA : CMD_READ_DMA);
+  outb (bm_command (c), inb (bm_command (c)) | BM_CMD_START);
+  sema_down (&c->completion_wait);
+  outb (bm_command (c), inb (bm_command (c)) & ~BM_CMD_START);
+
+  status = inb (bm_status (c));
+  outb (bm_status (c), status | BM_STA_ERR | BM_STA_IRQ);
+  if ((status & BM_STA_ERR) || (inb (reg_alt_status (c)) & STA_ERR))
+    PANIC ("%s: disk %s failed, sector=%"PRDSNu,
+           d->name, write ? "write" : "read", sec_no);
+}
+
 /* Low-level ATA primitives. */
 
 /* Wait up to 10 seconds for the controller to become idle, that
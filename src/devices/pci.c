@@ -0,0 +1,90 @@
+#include "devices/pci.h"
+#include <debug.h>
+#include "threads/io.h"
+
+/* This code reads and writes PCI configuration space using
+   configuration mechanism #1, which every PC with a PCI bus
+   supports.  See [PCI] for details. */
+
+/* I/O port addresses. */
+#define CONFIG_ADDRESS 0xcf8    /* Selects a configuration register. */
+#define CONFIG_DATA 0xcfc       /* Contains the selected register. */
+
+/* CONFIG_ADDRESS bits. */
+#define ADDR_ENABLE 0x80000000  /* Access configuration space. */
+
+/* Header type bit for a device with more than one function. */
+#define HEADER_MULTI 0x80
+
+static void select_register (const struct pci_func *, uint8_t reg);
+
+/* Reads the 32-bit configuration register REG, which must be a
+   multiple of 4, of function F. */
+uint32_t
+pci_read_config (const struct pci_func *f, uint8_t reg)
+{
+  select_register (f, reg);
+  return inl (CONFIG_DATA);
+}
+
+/* Writes DATA to the 32-bit configuration register REG, which
+   must be a multiple of 4, of function F. */
+void
+pci_write_config (const struct pci_func *f, uint8_t reg, uint32_t data)
+{
+  select_register (f, reg);
+  outl (CONFIG_DATA, data);
+}
+
+/* Searches the PCI buses for the first function with the given
+   CLASS and SUBCLASS codes.  If one is found, stores it in *F and
+   returns true.  Returns false otherwise, or if the machine has
+   no PCI bus. */
+bool
+pci_find_class (uint8_t class, uint8_t subclass, struct pci_func *f)
+{
+  int bus, dev, func;
+
+  for (bus = 0; bus < 256; bus++)
+    for (dev = 0; dev < 32; dev++)
+      for (func = 0; func < 8; func++)
+        {
+          uint32_t class_reg;
+
+          f->bus = bus;
+          f->dev = dev;
+          f->func = func;
+
+          /* No device answers with vendor ID 0xffff. */
+          if ((pci_read_config (f, PCI_REG_ID) & 0xffff) == 0xffff)
+            {
+              if (func == 0)
+                break;
+              continue;
+            }
+
+          class_reg = pci_read_config (f, PCI_REG_CLASS);
+          if ((class_reg >> 24) == class
+              && ((class_reg >> 16) & 0xff) == subclass)
+            return true;
+
+          /* Only a multi-function device has functions past 0. */
+          if (func == 0
+              && !(pci_read_config (f, PCI_REG_HEADER) & (HEADER_MULTI << 16)))
+            break;
+        }
+  return false;
+}
+
+/* Points CONFIG_DATA at configuration register REG of
+   function F. */
+static void
+select_register (const struct pci_func *f, uint8_t reg)
+{
+  ASSERT (f->dev < 32 && f->func < 8);
+  ASSERT (reg % 4 == 0);
+
+  outl (CONFIG_ADDRESS, (ADDR_ENABLE | (uint32_t) f->bus << 16
+                         | (uint32_t) f->dev << 11 | (uint32_t) f->func << 8
+                         | reg));
+}
@@ -0,0 +1,34 @@
+#ifndef DEVICES_PCI_H
+#define DEVICES_PCI_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* A function of a device on the PCI bus. */
+struct pci_func
+  {
+    uint8_t bus;                /* Bus number. */
+    uint8_t dev;                /* Device number on the bus, 0...31. */
+    uint8_t func;               /* Function of the device, 0...7. */
+  };
+
+/* Configuration space registers. */
+#define PCI_REG_ID 0x00         /* Vendor ID (low), device ID (high). */
+#define PCI_REG_COMMAND 0x04    /* Command (low), status (high). */
+#define PCI_REG_CLASS 0x08      /* Revision, prog-if, subclass, class. */
+#define PCI_REG_HEADER 0x0c     /* Header type in bits 16...23. */
+#define PCI_REG_BAR(N) (0x10 + 4 * (N)) /* Base address register N. */
+
+/* Command register bits. */
+#define PCI_CMD_IO 0x0001       /* Respond to I/O space accesses. */
+#define PCI_CMD_MASTER 0x0004   /* May act as bus master. */
+
+/* A base address register with this bit set maps I/O ports,
+   which start at the address with the low 2 bits cleared. */
+#define PCI_BAR_IO 0x1
+
+uint32_t pci_read_config (const struct pci_func *, uint8_t reg);
+void pci_write_config (const struct pci_func *, uint8_t reg, uint32_t);
+bool pci_find_class (uint8_t class, uint8_t subclass, struct pci_func *);
+
+#endif /* devices/pci.h */
@@ -0,0 +1,619 @@
+#include "filesys/cache.h"
+#include <debug.h>
+#include <string.h>
+#include "filesys/filesys.h"
+#include "filesys/free-map.h"
+#include "filesys/journal.h"
+#include "devices/timer.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+
+/* A single sector held in the buffer cache. */
+struct cache_entry
+{
+  block_sector_t sector;              /* Sector held in this slot. */
+  bool valid;                         /* True if SECTOR is meaningful. */
+  bool dirty;                         /* True if DATA differs from disk. */
+  bool accessed;                      /* Second chance bit for the clock. */
+  bool logged;                        /* Held for a journal transaction. */
+  int pin_cnt;                        /* Number of threads using the slot. */
+  struct lock data_lock;              /* Held while DATA is read or written. */
+  struct block_request io;            /* Transfer of DATA in flight, used
+                                         by whoever holds data_lock. */
+  uint8_t data[BLOCK_SECTOR_SIZE];    /* Cached sector contents. */
+};
+
+/* The buffer cache. Every sector of the file system device that
+   is read or written goes through one of these slots. */
+static struct cache_entry cache[CACHE_SIZE];
+
+/* Protects the sector, valid, dirty, accessed and pin_cnt members
+   of every slot, as well as the clock hand and dirty count. Never
+   held while waiting on a slot's data_lock. */
+static struct lock cache_lock;
+
+/* Next slot the clock algorithm will look at. */
+static size_t clock_hand;
+
+/* Number of dirty slots. */
+static size_t dirty_cnt;
+
+/* Set when the flusher has been asked for a pass it has not
+   started yet, either because too many slots are dirty or because
+   FLUSH_INTERVAL has passed. */
+static bool flush_requested;
+
+/* Upped once for each pass the flusher is asked for. */
+static struct semaphore flush_wanted;
+
+/* Sectors waiting to be brought into the cache by the read-ahead
+   worker, as a ring buffer. */
+static block_sector_t readahead_queue[READAHEAD_QUEUE_SIZE];
+static size_t readahead_head;         /* Index of the oldest request. */
+static size_t readahead_cnt;          /* Number of queued requests. */
+static struct lock readahead_lock;    /* Protects the queue. */
+static struct condition readahead_cond; /* Signaled on new requests. */
+
+/* Group commit for cache_sync(). Callers that arrive while a pass
+   is being gathered join it instead of each running their own. */
+static struct lock sync_lock;         /* Protects the members below. */
+static struct condition sync_done;    /* Signaled when a pass finishes. */
+static unsigned sync_started;         /* Passes that have begun writing. */
+static unsigned sync_finished;        /* Passes that have completed. */
+static bool sync_running;             /* A leader is gathering or writing. */
+
+static struct cache_entry *cache_lookup (block_sector_t);
+static struct cache_entry *cache_evict (void);
+static struct cache_entry *cache_claim (block_sector_t, bool *hit);
+static struct cache_entry *cache_get (block_sector_t, bool load);
+static void cache_put (struct cache_entry *);
+static void cache_mark_dirty (struct cache_entry *);
+static void cache_io_start (struct cache_entry *, bool write);
+static bool cache_write_start (struct cache_entry *);
+static void cache_write_finish (struct cache_entry *);
+static void flush_request (void);
+static void flusher (void *);
+static void flush_timer (void *);
+static void readahead_worker (void *);
+
+/* Initializes the buffer cache. */
+void
+cache_init (void)
+{
+  lock_init (&cache_lock);
+  for (size_t i = 0; i < CACHE_SIZE; i++)
+  {
+    cache[i].valid = false;
+    cache[i].dirty = false;
+    cache[i].accessed = false;
+    cache[i].logged = false;
+    cache[i].pin_cnt = 0;
+    lock_init (&cache[i].data_lock);
+  }
+  clock_hand = 0;
+  dirty_cnt = 0;
+  flush_requested = false;
+  sema_init (&flush_wanted, 0);
+
+  lock_init (&readahead_lock);
+  cond_init (&readahead_cond);
+  readahead_head = 0;
+  readahead_cnt = 0;
+
+  lock_init (&sync_lock);
+  cond_init (&sync_done);
+  sync_started = 0;
+  sync_finished = 0;
+  sync_running = false;
+
+  thread_create ("readahead", PRI_DEFAULT, readahead_worker, NULL);
+  thread_create ("flusher", PRI_DEFAULT, flusher, NULL);
+  thread_create ("flush-timer", PRI_DEFAULT, flush_timer, NULL);
+}
+
+/* Reads SECTOR of the file system device into BUFFER, which must
+   have room for BLOCK_SECTOR_SIZE bytes. Served from memory if
+   SECTOR is already cached. */
+void
+cache_read (block_sector_t sector, void *buffer)
+{
+  struct cache_entry *e = cache_get (sector, true);
+  memcpy (buffer, e->data, BLOCK_SECTOR_SIZE);
+  cache_put (e);
+}
+
+/* Reads SIZE bytes of SECTOR, starting OFS bytes into the sector,
+   into BUFFER. */
+void
+cache_read_at (block_sector_t sector, void *buffer, off_t ofs, off_t size)
+{
+  ASSERT (ofs >= 0 && size >= 0 && ofs + size <= BLOCK_SECTOR_SIZE);
+
+  struct cache_entry *e = cache_get (sector, true);
+  memcpy (buffer, e->data + ofs, size);
+  cache_put (e);
+}
+
+/* Reads the CNT consecutive sectors starting at SECTOR into
+   BUFFER, which must have room for CNT * BLOCK_SECTOR_SIZE bytes.
+   Sectors that are cached are copied from the cache. Each run of
+   sectors that are not is read from disk straight into BUFFER
+   with a single request, without being brought into the cache. */
+void
+cache_read_multiple (block_sector_t sector, size_t cnt, void *buffer)
+{
+  uint8_t *p = buffer;
+
+  while (cnt > 0)
+  {
+    /* A sector not cached now is up to date on disk. Eviction
+       writes back under cache_lock before a slot is let go. */
+    size_t run = 0;
+    lock_acquire (&cache_lock);
+    while (run < cnt && cache_lookup (sector + run) == NULL)
+      run++;
+    lock_release (&cache_lock);
+
+    if (run == 0)
+    {
+      cache_read (sector, p);
+      run = 1;
+    }
+    else
+      block_read_multiple (fs_device, sector, run, p);
+
+    sector += run;
+    p += run * BLOCK_SECTOR_SIZE;
+    cnt -= run;
+  }
+}
+
+/* Writes BLOCK_SECTOR_SIZE bytes from BUFFER into the cached copy
+   of SECTOR and returns without touching the disk. The flusher
+   thread writes the data back later, or eviction does if that
+   comes first. */
+void
+cache_write (block_sector_t sector, const void *buffer)
+{
+  /* The whole sector is overwritten, no need to read it first. */
+  struct cache_entry *e = cache_get (sector, false);
+  memcpy (e->data, buffer, BLOCK_SECTOR_SIZE);
+  cache_mark_dirty (e);
+  cache_put (e);
+}
+
+/* Writes SIZE bytes from BUFFER into the cached copy of SECTOR,
+   starting OFS bytes into the sector. The rest of the sector is
+   only read from disk if it is not cached and the write does not
+   cover all of it. */
+void
+cache_write_at (block_sector_t sector, const void *buffer,
+                off_t ofs, off_t size)
+{
+  ASSERT (ofs >= 0 && size >= 0 && ofs + size <= BLOCK_SECTOR_SIZE);
+
+  struct cache_entry *e = cache_get (sector, size < BLOCK_SECTOR_SIZE);
+  memcpy (e->data + ofs, buffer, size);
+  cache_mark_dirty (e);
+  cache_put (e);
+}
+
+/* Like cache_write_at(), but also holds SECTOR in the cache,
+   unwritten, until cache_unlog() is called for it. Used by the
+   journal, which must get a change into its log before the
+   sector itself may be written back. */
+void
+cache_write_logged (block_sector_t sector, const void *buffer,
+                    off_t ofs, off_t size)
+{
+  ASSERT (ofs >= 0 && size >= 0 && ofs + size <= BLOCK_SECTOR_SIZE);
+
+  struct cache_entry *e = cache_get (sector, size < BLOCK_SECTOR_SIZE);
+  lock_acquire (&cache_lock);
+  e->logged = true;
+  lock_release (&cache_lock);
+  memcpy (e->data + ofs, buffer, size);
+  cache_mark_dirty (e);
+  cache_put (e);
+}
+
+/* Lets SECTOR, held by cache_write_logged(), be written back and
+   evicted again. */
+void
+cache_unlog (block_sector_t sector)
+{
+  struct cache_entry *e = cache_get (sector, true);
+  lock_acquire (&cache_lock);
+  e->logged = false;
+  lock_release (&cache_lock);
+  cache_put (e);
+}
+
+/* Writes every dirty slot back to disk.
+   Pending free map changes are brought into the cache first, so
+   a pass never writes inode blocks that point at sectors whose
+   allocation it leaves unwritten. */
+void
+cache_flush (void)
+{
+  free_map_flush ();
+  cache_write_dirty ();
+}
+
+/* Writes every dirty slot not held for the journal back to disk.
+   Slots are written in ascending sector order so adjacent dirty
+   sectors go out back to back in a single sweep of the disk. */
+void
+cache_write_dirty (void)
+{
+  struct cache_entry *dirty[CACHE_SIZE];
+  bool started[CACHE_SIZE];
+  size_t cnt = 0;
+
+  /* Pin every dirty slot so none of them is evicted meanwhile. */
+  lock_acquire (&cache_lock);
+  for (size_t i = 0; i < CACHE_SIZE; i++)
+    if (cache[i].valid && cache[i].dirty && !cache[i].logged)
+    {
+      cache[i].pin_cnt++;
+      dirty[cnt++] = &cache[i];
+    }
+  flush_requested = false;
+  lock_release (&cache_lock);
+
+  /* Insertion sort by sector, there are at most CACHE_SIZE. */
+  for (size_t i = 1; i < cnt; i++)
+  {
+    struct cache_entry *e = dirty[i];
+    size_t j;
+    for (j = i; j > 0 && dirty[j - 1]->sector > e->sector; j--)
+      dirty[j] = dirty[j - 1];
+    dirty[j] = e;
+  }
+
+  /* Every write is in flight before the first is waited for, so
+     the disk queue can merge neighbours. Taking the data_locks in
+     sector order keeps concurrent passes from deadlocking. */
+  for (size_t i = 0; i < cnt; i++)
+  {
+    lock_acquire (&dirty[i]->data_lock);
+    started[i] = cache_write_start (dirty[i]);
+  }
+  for (size_t i = 0; i < cnt; i++)
+  {
+    if (started[i])
+      cache_write_finish (dirty[i]);
+    cache_put (dirty[i]);
+  }
+}
+
+/* Commits the journal's running transaction and writes every
+   dirty slot back to disk like cache_flush(), and does not return
+   before a pass that began after the call has completed, so
+   everything written before the call is on disk.
+   The first caller waits SYNC_GROUP_DELAY ticks before flushing;
+   callers arriving meanwhile share its pass, and callers arriving
+   while it writes share the next one. */
+void
+cache_sync (void)
+{
+  lock_acquire (&sync_lock);
+  unsigned target = sync_started + 1;
+  while (sync_finished < target)
+  {
+    if (sync_running)
+    {
+      cond_wait (&sync_done, &sync_lock);
+      continue;
+    }
+
+    /* Lead the next pass. */
+    sync_running = true;
+    lock_release (&sync_lock);
+    timer_sleep (SYNC_GROUP_DELAY);
+
+    lock_acquire (&sync_lock);
+    unsigned pass = ++sync_started;
+    lock_release (&sync_lock);
+
+    journal_commit ();
+    cache_flush ();
+
+    lock_acquire (&sync_lock);
+    sync_finished = pass;
+    sync_running = false;
+    cond_broadcast (&sync_done, &sync_lock);
+  }
+  lock_release (&sync_lock);
+}
+
+/* Asks the read-ahead worker to bring SECTOR into the cache in
+   the background. Does not wait for it. The request is dropped
+   if too many are already pending. */
+void
+cache_readahead (block_sector_t sector)
+{
+  lock_acquire (&readahead_lock);
+  if (readahead_cnt < READAHEAD_QUEUE_SIZE)
+  {
+    size_t tail = (readahead_head + readahead_cnt) % READAHEAD_QUEUE_SIZE;
+    readahead_queue[tail] = sector;
+    readahead_cnt++;
+    cond_signal (&readahead_cond, &readahead_lock);
+  }
+  lock_release (&readahead_lock);
+}
+
+/* HELPERS */
+
+/* Returns the slot holding SECTOR, or NULL if it is not cached.
+   Caller must hold cache_lock. */
+static struct cache_entry *
+cache_lookup (block_sector_t sector)
+{
+  for (size_t i = 0; i < CACHE_SIZE; i++)
+    if (cache[i].valid && cache[i].sector == sector)
+      return &cache[i];
+  return NULL;
+}
+
+/* Picks an unpinned slot not held for the journal using the clock
+   (second chance) algorithm, writing its contents back first if
+   dirty. Returns NULL if there is none.
+   Caller must hold cache_lock. */
+static struct cache_entry *
+cache_evict (void)
+{
+  /* Two sweeps are enough to clear every accessed bit once. */
+  for (size_t n = 0; n < 2 * CACHE_SIZE; n++)
+  {
+    struct cache_entry *e = &cache[clock_hand];
+    clock_hand = (clock_hand + 1) % CACHE_SIZE;
+
+    if (e->pin_cnt > 0 || e->logged)
+      continue;
+    if (e->valid && e->accessed)
+    {
+      e->accessed = false;
+      continue;
+    }
+
+    /* Nobody has the slot pinned so nobody holds its data_lock.
+       Writing back under cache_lock keeps anyone from reading a
+       stale copy of the old sector off the disk meanwhile. */
+    if (e->valid && e->dirty)
+    {
+      block_write (fs_device, e->sector, e->data);
+      dirty_cnt--;
+    }
+    e->valid = false;
+    e->dirty = false;
+    return e;
+  }
+  return NULL;
+}
+
+/* Returns the slot for SECTOR pinned and with its data_lock held,
+   and sets *HIT to whether SECTOR was cached already. On a miss
+   the slot's data is left for the caller to fill in. Release with
+   cache_put(). */
+static struct cache_entry *
+cache_claim (block_sector_t sector, bool *hit)
+{
+  struct cache_entry *e;
+
+  lock_acquire (&cache_lock);
+  for (;;)
+  {
+    e = cache_lookup (sector);
+    if (e != NULL)
+    {
+      e->pin_cnt++;
+      e->accessed = true;
+      lock_release (&cache_lock);
+
+      /* Waits for a concurrent miss on the same sector to finish
+         loading. */
+      lock_acquire (&e->data_lock);
+      *hit = true;
+      return e;
+    }
+
+    e = cache_evict ();
+    if (e != NULL)
+      break;
+
+    /* Every slot is in use, let someone finish. */
+    lock_release (&cache_lock);
+    thread_yield ();
+    lock_acquire (&cache_lock);
+  }
+
+  e->sector = sector;
+  e->valid = true;
+  e->accessed = true;
+  e->pin_cnt = 1;
+  lock_acquire (&e->data_lock);
+  lock_release (&cache_lock);
+  *hit = false;
+  return e;
+}
+
+/* Returns the slot for SECTOR pinned and with its data_lock held,
+   bringing it into the cache if needed. If LOAD is false the
+   caller is about to overwrite the whole sector so its contents
+   are not read from disk on a miss. Release with cache_put(). */
+static struct cache_entry *
+cache_get (block_sector_t sector, bool load)
+{
+  bool hit;
+  struct cache_entry *e = cache_claim (sector, &hit);
+
+  if (hit)
+    return e;
+  if (load)
+    block_read (fs_device, sector, e->data);
+  else
+    memset (e->data, 0, BLOCK_SECTOR_SIZE);
+  return e;
+}
+
+/* Releases a slot obtained from cache_get(). */
+static void
+cache_put (struct cache_entry *e)
+{
+  lock_release (&e->data_lock);
+
+  lock_acquire (&cache_lock);
+  ASSERT (e->pin_cnt > 0);
+  e->pin_cnt--;
+  lock_release (&cache_lock);
+}
+
+/* Marks E, whose data_lock must be held, as differing from disk.
+   Asks the flusher for an early pass if too much is dirty. */
+static void
+cache_mark_dirty (struct cache_entry *e)
+{
+  lock_acquire (&cache_lock);
+  if (!e->dirty)
+  {
+    e->dirty = true;
+    dirty_cnt++;
+    if (dirty_cnt > FLUSH_THRESHOLD)
+      flush_request ();
+  }
+  lock_release (&cache_lock);
+}
+
+/* Starts transferring E's data between memory and disk, to disk
+   if WRITE is true. E must be pinned and its data_lock held until
+   the transfer completes. */
+static void
+cache_io_start (struct cache_entry *e, bool write)
+{
+  e->io.write = write;
+  e->io.sector = e->sector;
+  e->io.cnt = 1;
+  e->io.buffer = e->data;
+  e->io.done = NULL;
+  e->io.aux = NULL;
+  block_submit (fs_device, &e->io);
+}
+
+/* Starts writing E back to disk if it is dirty and not held for
+   the journal, and returns true if it did. E must be pinned and
+   its data_lock held; finish with cache_write_finish(). */
+static bool
+cache_write_start (struct cache_entry *e)
+{
+  if (!e->dirty || e->logged)
+    return false;
+
+  cache_io_start (e, true);
+  return true;
+}
+
+/* Waits for the write started on E to reach the disk, then marks
+   E clean. */
+static void
+cache_write_finish (struct cache_entry *e)
+{
+  block_wait (&e->io);
+
+  lock_acquire (&cache_lock);
+  e->dirty = false;
+  dirty_cnt--;
+  lock_release (&cache_lock);
+}
+
+/* Asks the flusher for a pass, unless one is already pending.
+   Caller must hold cache_lock. */
+static void
+flush_request (void)
+{
+  if (!flush_requested)
+  {
+    flush_requested = true;
+    sema_up (&flush_wanted);
+  }
+}
+
+/* Kernel thread that writes dirty sectors back in the background
+   whenever flush_request() asks it to. It sleeps until then. */
+static void
+flusher (void *aux UNUSED)
+{
+  for (;;)
+  {
+    sema_down (&flush_wanted);
+    journal_commit ();
+    cache_flush ();
+  }
+}
+
+/* Kernel thread that asks the flusher for a pass every
+   FLUSH_INTERVAL ticks, so nothing stays dirty for much longer
+   than that. */
+static void
+flush_timer (void *aux UNUSED)
+{
+  for (;;)
+  {
+    timer_sleep (FLUSH_INTERVAL);
+
+    lock_acquire (&cache_lock);
+    flush_request ();
+    lock_release (&cache_lock);
+  }
+}
+
+/* Kernel thread that services cache_readahead() requests, so
+   the disk transfer overlaps with whatever the requester does
+   next. Up to READAHEAD_BATCH sectors are read at once, which
+   lets the disk queue order and merge them. */
+static void
+readahead_worker (void *aux UNUSED)
+{
+  for (;;)
+  {
+    block_sector_t sectors[READAHEAD_BATCH];
+    struct cache_entry *loading[READAHEAD_BATCH];
+    size_t cnt = 0, load_cnt = 0;
+
+    lock_acquire (&readahead_lock);
+    while (readahead_cnt == 0)
+      cond_wait (&readahead_cond, &readahead_lock);
+    while (readahead_cnt > 0 && cnt < READAHEAD_BATCH)
+    {
+      sectors[cnt++] = readahead_queue[readahead_head];
+      readahead_head = (readahead_head + 1) % READAHEAD_QUEUE_SIZE;
+      readahead_cnt--;
+    }
+    lock_release (&readahead_lock);
+
+    for (size_t i = 0; i < cnt; i++)
+    {
+      bool hit, dup = false;
+      for (size_t j = 0; j < i; j++)
+        dup = dup || sectors[j] == sectors[i];
+      if (dup)
+        continue;
+
+      /* Nothing to do on a hit. */
+      struct cache_entry *e = cache_claim (sectors[i], &hit);
+      if (hit)
+        cache_put (e);
+      else
+      {
+        cache_io_start (e, false);
+        loading[load_cnt++] = e;
+      }
+    }
+    for (size_t i = 0; i < load_cnt; i++)
+    {
+      block_wait (&loading[i]->io);
+      cache_put (loading[i]);
+    }
+  }
+}
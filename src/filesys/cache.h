@@ -0,0 +1,39 @@
+#ifndef FILESYS_CACHE_H
+#define FILESYS_CACHE_H
+
+#include "devices/block.h"
+#include "filesys/off_t.h"
+
+/* Number of sectors held in the buffer cache. */
+#define CACHE_SIZE 64
+
+/* The flusher thread writes dirty sectors back every
+   FLUSH_INTERVAL timer ticks, or sooner once more than
+   FLUSH_THRESHOLD sectors are dirty. */
+#define FLUSH_INTERVAL 100
+#define FLUSH_THRESHOLD (CACHE_SIZE / 2)
+
+/* Maximum number of pending read-ahead requests. */
+#define READAHEAD_QUEUE_SIZE 32
+
+/* Most read-ahead requests the worker has in flight at once. */
+#define READAHEAD_BATCH 8
+
+/* Timer ticks the first caller of cache_sync() waits for others
+   to join before it starts the flush they all share. */
+#define SYNC_GROUP_DELAY 1
+
+void cache_init (void);
+void cache_read (block_sector_t, void *);
+void cache_read_at (block_sector_t, void *, off_t ofs, off_t size);
+void cache_read_multiple (block_sector_t, size_t cnt, void *);
+void cache_write (block_sector_t, const void *);
+void cache_write_at (block_sector_t, const void *, off_t ofs, off_t size);
+void cache_write_logged (block_sector_t, const void *, off_t ofs, off_t size);
+void cache_unlog (block_sector_t);
+void cache_flush (void);
+void cache_write_dirty (void);
+void cache_sync (void);
+void cache_readahead (block_sector_t);
+
+#endif /* filesys/cache.h */
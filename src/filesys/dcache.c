@@ -0,0 +1,87 @@
+#include "filesys/dcache.h"
+#include <hash.h>
+#include <string.h>
+#include "filesys/directory.h"
+#include "threads/synch.h"
+
+/* Remembers what NAME in the directory whose inode is in sector
+   DIR refers to. */
+struct dentry
+{
+  bool valid;                         /* True if the slot is in use. */
+  block_sector_t dir;                 /* Inode sector of the directory. */
+  char name[NAME_MAX + 1];            /* Null terminated file name. */
+  block_sector_t child;               /* Inode sector NAME refers to, or DCACHE_NONE. */
+};
+
+/* The dentry cache. Each (directory, name) pair can only live in
+   the slot it hashes to, replacing whatever was there. */
+static struct dentry dcache[DCACHE_SIZE];
+
+/* Protects dcache. */
+static struct lock dcache_lock;
+
+/* Returns the slot for NAME in directory DIR. */
+static struct dentry *
+dcache_slot (block_sector_t dir, const char *name)
+{
+  unsigned h = hash_string (name) ^ hash_int (dir);
+  return &dcache[h & (DCACHE_SIZE - 1)];
+}
+
+/* Initializes the dentry cache. */
+void
+dcache_init (void)
+{
+  lock_init (&dcache_lock);
+  for (size_t i = 0; i < DCACHE_SIZE; i++)
+    dcache[i].valid = false;
+}
+
+/* Looks up NAME in directory DIR. If the answer is cached, stores
+   the inode sector NAME refers to in *CHILD, or DCACHE_NONE if
+   NAME is known not to exist, and returns true. Returns false if
+   DIR itself must be searched. */
+bool
+dcache_lookup (block_sector_t dir, const char *name, block_sector_t *child)
+{
+  bool hit;
+
+  lock_acquire (&dcache_lock);
+  struct dentry *d = dcache_slot (dir, name);
+  hit = d->valid && d->dir == dir && !strcmp (d->name, name);
+  if (hit)
+    *child = d->child;
+  lock_release (&dcache_lock);
+  return hit;
+}
+
+/* Records that NAME in directory DIR refers to the inode in
+   sector CHILD, or to nothing if CHILD is DCACHE_NONE. Names too
+   long to be in a directory are not recorded. */
+void
+dcache_insert (block_sector_t dir, const char *name, block_sector_t child)
+{
+  if (strlen (name) > NAME_MAX)
+    return;
+
+  lock_acquire (&dcache_lock);
+  struct dentry *d = dcache_slot (dir, name);
+  d->valid = true;
+  d->dir = dir;
+  strlcpy (d->name, name, sizeof d->name);
+  d->child = child;
+  lock_release (&dcache_lock);
+}
+
+/* Forgets every name cached for directory DIR. Must be called
+   before DIR's sector can be reused. */
+void
+dcache_invalidate_dir (block_sector_t dir)
+{
+  lock_acquire (&dcache_lock);
+  for (size_t i = 0; i < DCACHE_SIZE; i++)
+    if (dcache[i].valid && dcache[i].dir == dir)
+      dcache[i].valid = false;
+  lock_release (&dcache_lock);
+}
@@ -0,0 +1,19 @@
+#ifndef FILESYS_DCACHE_H
+#define FILESYS_DCACHE_H
+
+#include <stdbool.h>
+#include "devices/block.h"
+
+/* Number of (directory, name) pairs remembered. Must be a power
+   of 2. */
+#define DCACHE_SIZE 256
+
+/* Stands for the child of a name known not to exist. */
+#define DCACHE_NONE ((block_sector_t) -1)
+
+void dcache_init (void);
+bool dcache_lookup (block_sector_t dir, const char *name, block_sector_t *);
+void dcache_insert (block_sector_t dir, const char *name, block_sector_t);
+void dcache_invalidate_dir (block_sector_t dir);
+
+#endif /* filesys/dcache.h */
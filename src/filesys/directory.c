@@ -1,9 +1,13 @@
 #include "filesys/directory.h"
 #include <stdio.h>
 #include <string.h>
+#include <hash.h>
 #include <list.h>
+#include "filesys/dcache.h"
 #include "filesys/filesys.h"
+#include "filesys/free-map.h"
 #include "filesys/inode.h"
+#include "filesys/journal.h"
 #include "threads/malloc.h"
 
 /* A single directory entry. */
@@ -14,12 +18,40 @@ struct dir_entry
     bool in_use;                        /* In use or free? */
   };
 
+/* A directory gets a name index once it holds more than this
+   many entries. Smaller ones are just scanned. */
+#define DIR_INDEX_THRESHOLD 32
+
+/* Fewest slots an index is built with. Always a power of 2. */
+#define DIR_INDEX_MIN_SLOTS 128
+
+/* Entries added to an index being built under one journal
+   handle. Each insert touches one index sector, which with the
+   blocks and free map sectors allocating it and the two inodes
+   keeps a step within JOURNAL_HANDLE_MAX. */
+#define DIR_INDEX_BUILD_STEP 8
+
+/* The name index is an open addressed hash table, stored in its
+   own inode, of 32-bit slots. A slot holds the number of a
+   directory entry plus one, or one of these. */
+#define SLOT_EMPTY 0
+#define SLOT_DELETED 0xffffffff
+
+static bool scan (const struct dir *, const char *, off_t start,
+                  struct dir_entry *, off_t *);
+static bool index_lookup (const struct dir *, const char *,
+                          struct dir_entry *, off_t *, uint32_t *slotp);
+static void index_add (struct dir *, uint32_t entry_no);
+static void index_remove (struct dir *, uint32_t slot);
+static bool index_pending (const struct dir *);
+static bool index_build_step (struct dir *);
+
 /* Creates a directory with space for ENTRY_CNT entries in the
    given SECTOR.  Returns true if successful, false on failure. */
 bool
 dir_create (block_sector_t sector, size_t entry_cnt, block_sector_t parent_sector)
 {
-  return inode_create (sector, entry_cnt * sizeof (struct dir_entry), true, parent_sector);
+  return inode_create (sector, entry_cnt * sizeof (struct dir_entry), INODE_TYPE_DIR, parent_sector);
 }
 
 /* Opens and returns the directory for the given INODE, of which
@@ -85,13 +117,24 @@ static bool
 lookup (const struct dir *dir, const char *name,
         struct dir_entry *ep, off_t *ofsp) 
 {
-  struct dir_entry e;
-  size_t ofs;
-  
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
-  for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
+  if (dir->inode->data.dir_index != 0)
+    return index_lookup (dir, name, ep, ofsp, NULL);
+  return scan (dir, name, 0, ep, ofsp);
+}
+
+/* Searches DIR's entries from byte offset START onward for NAME,
+   one by one. Works like lookup(). */
+static bool
+scan (const struct dir *dir, const char *name, off_t start,
+      struct dir_entry *ep, off_t *ofsp)
+{
+  struct dir_entry e;
+  off_t ofs;
+
+  for (ofs = start; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
        ofs += sizeof e) 
     if (e.in_use && !strcmp (name, e.name)) 
       {
@@ -107,20 +150,32 @@ lookup (const struct dir *dir, const char *name,
 /* Searches DIR for a file with the given NAME
    and returns true if one exists, false otherwise.
    On success, sets *INODE to an inode for the file, otherwise to
-   a null pointer.  The caller must close *INODE. */
+   a null pointer.  The caller must close *INODE.
+   Answers are remembered in the dentry cache, whether or not the
+   file exists, unless DIR has been removed. */
 bool
 dir_lookup (const struct dir *dir, const char *name,
             struct inode **inode) 
 {
   struct dir_entry e;
+  block_sector_t dir_sector;
+  block_sector_t child;
 
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
-  if (lookup (dir, name, &e, NULL))
-    *inode = inode_open (e.inode_sector);
-  else
-    *inode = NULL;
+  /* Held across the open too, so that dir_remove() cannot free
+     the child between finding it and opening it. */
+  dir_sector = inode_get_inumber (dir->inode);
+  lock_acquire (&dir->inode->dir_lock);
+  if (!dcache_lookup (dir_sector, name, &child))
+    {
+      child = lookup (dir, name, &e, NULL) ? e.inode_sector : DCACHE_NONE;
+      if (!dir->inode->removed)
+        dcache_insert (dir_sector, name, child);
+    }
+  *inode = child != DCACHE_NONE ? inode_open (child) : NULL;
+  lock_release (&dir->inode->dir_lock);
 
   return *inode != NULL;
 }
@@ -130,7 +185,11 @@ dir_lookup (const struct dir *dir, const char *name,
    INODE_SECTOR.
    Returns true if successful, false on failure.
    Fails if NAME is invalid (i.e. too long) or a disk or memory
-   error occurs. */
+   error occurs.
+   Adding an entry may start building a new name index for DIR.
+   Once no journal handle is open any more the caller finishes it
+   with dir_build_index(); until then DIR's entries are still all
+   found, if more slowly. */
 bool
 dir_add (struct dir *dir, const char *name, block_sector_t inode_sector)
 {
@@ -145,18 +204,27 @@ dir_add (struct dir *dir, const char *name, block_sector_t inode_sector)
   if (*name == '\0' || strlen (name) > NAME_MAX)
     return false;
 
-  /* Check that NAME is not in use. */
-  if (lookup (dir, name, NULL, NULL))
+  /* The entry, the name index and the directory's inode change
+     together or not at all. */
+  journal_begin ();
+  lock_acquire (&dir->inode->dir_lock);
+
+  /* Check that NAME is not in use, and that DIR is still there
+     to add it to. */
+  if (dir->inode->removed || lookup (dir, name, NULL, NULL))
     goto done;
 
   /* Set OFS to offset of free slot.
      If there are no free slots, then it will be set to the
-     current end-of-file.
+     current end-of-file. Every entry before the free hint is
+     known to be in use, so the search starts there.
      
      inode_read_at() will only return a short read at end of file.
      Otherwise, we'd need to verify that we didn't get a short
      read due to something intermittent such as low memory. */
-  for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
+  struct inode_disk *data = &dir->inode->data;
+  for (ofs = data->dir_free_hint * sizeof e;
+       inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
        ofs += sizeof e) 
     if (!e.in_use)
       break;
@@ -167,10 +235,45 @@ dir_add (struct dir *dir, const char *name, block_sector_t inode_sector)
   e.inode_sector = inode_sector;
   off_t t = inode_write_at (dir->inode, &e, sizeof e, ofs);
   success = t == sizeof e;
+  if (success)
+    {
+      data->dir_free_hint = ofs / sizeof e + 1;
+      data->dir_entry_cnt++;
+      if (data->dir_index != 0 || data->dir_entry_cnt > DIR_INDEX_THRESHOLD)
+        index_add (dir, ofs / sizeof e);
+      inode_mark_dirty (dir->inode);
+      if (!dir->inode->removed)
+        dcache_insert (inode_get_inumber (dir->inode), name, inode_sector);
+    }
  done:
+  lock_release (&dir->inode->dir_lock);
+  journal_end ();
   return success;
 }
 
+/* Finishes building DIR's name index, if dir_add() started one,
+   DIR_INDEX_BUILD_STEP entries per journal handle so that the
+   index can grow past what one handle may log.
+   Must be called with no journal handle open. */
+void
+dir_build_index (struct dir *dir)
+{
+  struct inode *inode = dir->inode;
+
+  lock_acquire (&inode->dir_lock);
+  bool more = !inode->removed && index_pending (dir);
+  lock_release (&inode->dir_lock);
+
+  while (more)
+    {
+      journal_begin ();
+      lock_acquire (&inode->dir_lock);
+      more = !inode->removed && index_build_step (dir);
+      lock_release (&inode->dir_lock);
+      journal_end ();
+    }
+}
+
 /* Removes any entry for NAME in DIR.
    Returns true if successful, false on failure,
    which occurs only if there is no file with the given NAME. */
@@ -181,12 +284,21 @@ dir_remove (struct dir *dir, const char *name)
   struct inode *inode = NULL;
   bool success = false;
   off_t ofs;
+  uint32_t slot = SLOT_EMPTY;
 
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
+  journal_begin ();
+  lock_acquire (&dir->inode->dir_lock);
+
   /* Find directory entry. */
-  if (!lookup (dir, name, &e, &ofs))
+  if (dir->inode->data.dir_index != 0)
+    {
+      if (!index_lookup (dir, name, &e, &ofs, &slot))
+        goto done;
+    }
+  else if (!lookup (dir, name, &e, &ofs))
     goto done;
 
   /* Open inode. */
@@ -194,21 +306,52 @@ dir_remove (struct dir *dir, const char *name)
   if (inode == NULL)
     goto done;
 
-  // Make sure directory is empty!!
-  if (!dir_is_empty (dir_open (inode)))
-    return false;
+  // Make sure directory is empty!! Nothing may be added to it
+  // until it is marked removed.
+  if (is_dir (inode))
+  {
+    struct dir *child = dir_open (inode_reopen (inode));
+    lock_acquire (&inode->dir_lock);
+    bool empty = child != NULL && dir_is_empty (child);
+    dir_close (child);
+    if (!empty)
+    {
+      lock_release (&inode->dir_lock);
+      goto done;
+    }
+  }
 
   /* Erase directory entry. */
   e.in_use = false;
   if (inode_write_at (dir->inode, &e, sizeof e, ofs) != sizeof e) 
+  {
+    if (is_dir (inode))
+      lock_release (&inode->dir_lock);
     goto done;
+  }
+  struct inode_disk *data = &dir->inode->data;
+  data->dir_entry_cnt--;
+  if (ofs / sizeof e < data->dir_free_hint)
+    data->dir_free_hint = ofs / sizeof e;
+  if (slot != SLOT_EMPTY)
+    index_remove (dir, slot);
+  inode_mark_dirty (dir->inode);
+
+  /* NAME is gone, and so is anything cached under it should its
+     sector be reused for another directory. */
+  dcache_insert (inode_get_inumber (dir->inode), name, DCACHE_NONE);
+  dcache_invalidate_dir (e.inode_sector);
 
   /* Remove inode. */
   inode_remove (inode);
+  if (is_dir (inode))
+    lock_release (&inode->dir_lock);
   success = true;
 
  done:
+  lock_release (&dir->inode->dir_lock);
   inode_close (inode);
+  journal_end ();
   return success;
 }
 
@@ -302,14 +445,16 @@ resolve_path (char *path, struct dir *start, char last_segment[NAME_MAX + 1], bo
 
   char last[NAME_MAX + 1];
   
-  // Make a copy of path so we don't modify it in strtok_r
-  path_cpy = malloc(sizeof(char) * strlen(path) + 1);
-  strlcpy (path_cpy, path, strlen(path) + 1);
-
   // Reject empty path
   if(!strcmp (path, ""))
     return NULL;
 
+  // Make a copy of path so we don't modify it in strtok_r
+  path_cpy = malloc(sizeof(char) * strlen(path) + 1);
+  if (path_cpy == NULL)
+    return NULL;
+  strlcpy (path_cpy, path, strlen(path) + 1);
+
   // Special case when path starts with root "/"
   if(!strncmp (path, "/", 1))
     start = dir_open_root ();
@@ -325,6 +470,7 @@ resolve_path (char *path, struct dir *start, char last_segment[NAME_MAX + 1], bo
     if (last_segment)
       strlcpy (last_segment, path, NAME_MAX + 1);
     
+    free (path_cpy);
     return start;
   }
 
@@ -332,7 +478,10 @@ resolve_path (char *path, struct dir *start, char last_segment[NAME_MAX + 1], bo
   {
     // Token can be one of: '.', '..', or a directory name
     if(strlen(token) > NAME_MAX)
+    {
+      free (path_cpy);
       return NULL;
+    }
     
     // Current directory
     if (!strcmp (token, "."))
@@ -373,6 +522,7 @@ resolve_path (char *path, struct dir *start, char last_segment[NAME_MAX + 1], bo
 
     token = strtok_r (NULL, "/", &save_ptr);
   }
+  free (path_cpy);
 
   if(last_segment)
     strlcpy (last_segment, last, NAME_MAX + 1);
@@ -424,3 +574,247 @@ print_fs_helper (struct dir *dir, int indent)
       print_fs_helper (dir_open (i), indent + 1);
   }
 }
+
+/* NAME INDEX */
+
+/* Returns the value in slot SLOT of INDEX. */
+static uint32_t
+slot_read (struct inode *index, uint32_t slot)
+{
+  uint32_t value = SLOT_EMPTY;
+  inode_read_at (index, &value, sizeof value, slot * sizeof value);
+  return value;
+}
+
+/* Stores VALUE in slot SLOT of INDEX. Returns true if successful. */
+static bool
+slot_write (struct inode *index, uint32_t slot, uint32_t value)
+{
+  return inode_write_at (index, &value, sizeof value, slot * sizeof value)
+         == sizeof value;
+}
+
+/* Searches DIR's name index for NAME, then the entries not in
+   the index yet, if it is still being built. Works like lookup(),
+   and also sets *SLOTP to the index slot naming the entry if SLOTP
+   is non-null and the entry is in the index. */
+static bool
+index_lookup (const struct dir *dir, const char *name,
+              struct dir_entry *ep, off_t *ofsp, uint32_t *slotp)
+{
+  const struct inode_disk *data = &dir->inode->data;
+  uint32_t mask = data->dir_index_slots - 1;
+  uint32_t slot = hash_string (name) & mask;
+  bool found = false;
+
+  struct inode *index = inode_open (data->dir_index);
+  if (index == NULL)
+    return scan (dir, name, 0, ep, ofsp);
+
+  for (uint32_t probes = 0; probes < data->dir_index_slots;
+       probes++, slot = (slot + 1) & mask)
+    {
+      struct dir_entry e;
+      uint32_t value = slot_read (index, slot);
+      if (value == SLOT_EMPTY)
+        break;
+      if (value == SLOT_DELETED)
+        continue;
+
+      off_t ofs = (value - 1) * sizeof e;
+      if (inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e
+          && e.in_use && !strcmp (name, e.name))
+        {
+          if (ep != NULL)
+            *ep = e;
+          if (ofsp != NULL)
+            *ofsp = ofs;
+          if (slotp != NULL)
+            *slotp = slot;
+          found = true;
+          break;
+        }
+    }
+
+  inode_close (index);
+  if (!found)
+    found = scan (dir, name, data->dir_index_built * sizeof (struct dir_entry),
+                  ep, ofsp);
+  return found;
+}
+
+/* Records that entry ENTRY_NO of DATA's directory is named NAME
+   in INDEX, in the first free slot from where NAME hashes to.
+   Returns true if successful. */
+static bool
+index_insert (struct inode *index, struct inode_disk *data,
+              const char *name, uint32_t entry_no)
+{
+  uint32_t mask = data->dir_index_slots - 1;
+  uint32_t slot = hash_string (name) & mask;
+  uint32_t value;
+
+  while ((value = slot_read (index, slot)) != SLOT_EMPTY
+         && value != SLOT_DELETED)
+    slot = (slot + 1) & mask;
+
+  if (!slot_write (index, slot, entry_no + 1))
+    return false;
+  if (value == SLOT_EMPTY)
+    data->dir_index_used++;
+  return true;
+}
+
+/* Throws away DIR's name index, if it has one. */
+static void
+index_drop (struct dir *dir)
+{
+  struct inode_disk *data = &dir->inode->data;
+  if (data->dir_index == 0)
+    return;
+
+  struct inode *index = inode_open (data->dir_index);
+  if (index != NULL)
+    {
+      inode_remove (index);
+      inode_close (index);
+    }
+  data->dir_index = 0;
+}
+
+/* Replaces DIR's name index, if any, with a new empty one with
+   room for twice as many entries as DIR has, which
+   index_build_step() then fills in. If that fails, DIR is left
+   without an index and is scanned instead. */
+static void
+index_start (struct dir *dir)
+{
+  struct inode_disk *data = &dir->inode->data;
+  uint32_t slots = DIR_INDEX_MIN_SLOTS;
+  block_sector_t sector;
+
+  index_drop (dir);
+
+  while (data->dir_entry_cnt * 2 > slots)
+    slots *= 2;
+
+  /* A new inode's data reads back as zeros, all SLOT_EMPTY. */
+  if (!free_map_allocate_near (1, inode_get_inumber (dir->inode), &sector))
+    return;
+  if (!inode_create (sector, slots * sizeof (uint32_t), INODE_TYPE_INDEX, 0))
+    {
+      free_map_release (sector, 1);
+      return;
+    }
+
+  data->dir_index = sector;
+  data->dir_index_slots = slots;
+  data->dir_index_used = 0;
+  data->dir_index_built = 0;
+}
+
+/* Returns true if DIR's name index is still being built, so some
+   of its entries are not in it yet. */
+static bool
+index_pending (const struct dir *dir)
+{
+  const struct inode_disk *data = &dir->inode->data;
+  return (data->dir_index != 0
+          && data->dir_index_built * sizeof (struct dir_entry)
+             < (size_t) inode_length (dir->inode));
+}
+
+/* Adds up to DIR_INDEX_BUILD_STEP more of DIR's entries to its
+   name index while it is being built. Returns true if some are
+   still left.
+   Caller must hold DIR's dir_lock and have a journal handle open. */
+static bool
+index_build_step (struct dir *dir)
+{
+  struct inode_disk *data = &dir->inode->data;
+  struct dir_entry e;
+  struct inode *index;
+  int added = 0;
+
+  if (!index_pending (dir))
+    return false;
+
+  index = inode_open (data->dir_index);
+  if (index == NULL)
+    {
+      index_drop (dir);
+      inode_mark_dirty (dir->inode);
+      return false;
+    }
+
+  while (added < DIR_INDEX_BUILD_STEP
+         && inode_read_at (dir->inode, &e, sizeof e,
+                           data->dir_index_built * sizeof e) == sizeof e)
+    {
+      if (e.in_use)
+        {
+          if (!index_insert (index, data, e.name, data->dir_index_built))
+            {
+              /* An index missing an entry is worse than none at all. */
+              inode_close (index);
+              index_drop (dir);
+              inode_mark_dirty (dir->inode);
+              return false;
+            }
+          added++;
+        }
+      data->dir_index_built++;
+    }
+  inode_close (index);
+  inode_mark_dirty (dir->inode);
+  return index_pending (dir);
+}
+
+/* Adds entry ENTRY_NO of DIR, just written, to DIR's name index.
+   Starts a new index if DIR does not have one yet, or once more
+   than 3/4 of its slots are taken, deleted ones included, so
+   probe sequences stay short. An entry the index is still being
+   built up to is left for index_build_step(). */
+static void
+index_add (struct dir *dir, uint32_t entry_no)
+{
+  struct inode_disk *data = &dir->inode->data;
+  struct dir_entry e;
+  struct inode *index;
+
+  if (data->dir_index == 0
+      || (data->dir_index_used + 1) * 4 > data->dir_index_slots * 3)
+    {
+      index_start (dir);
+      return;
+    }
+  if (entry_no > data->dir_index_built)
+    return;
+
+  index = inode_open (data->dir_index);
+  if (index == NULL
+      || inode_read_at (dir->inode, &e, sizeof e, entry_no * sizeof e)
+         != sizeof e
+      || !index_insert (index, data, e.name, entry_no))
+    {
+      /* An index missing an entry is worse than none at all. */
+      inode_close (index);
+      index_drop (dir);
+      return;
+    }
+  if (entry_no == data->dir_index_built)
+    data->dir_index_built++;
+  inode_close (index);
+}
+
+/* Marks slot SLOT of DIR's name index as deleted. */
+static void
+index_remove (struct dir *dir, uint32_t slot)
+{
+  struct inode *index = inode_open (dir->inode->data.dir_index);
+  if (index != NULL)
+    {
+      slot_write (index, slot, SLOT_DELETED);
+      inode_close (index);
+    }
+}
@@ -2,32 +2,51 @@
 #include <debug.h>
 #include <stdio.h>
 #include <string.h>
+#include "filesys/cache.h"
+#include "filesys/dcache.h"
 #include "filesys/file.h"
 #include "filesys/free-map.h"
 #include "filesys/inode.h"
 #include "filesys/directory.h"
+#include "filesys/journal.h"
 
 /* Partition that contains the file system. */
 struct block *fs_device;
 
-static void do_format (void);
+static void do_format (enum inode_layout);
+static block_sector_t placement (struct dir *, bool isDir);
 
 /* Initializes the file system module.
-   If FORMAT is true, reformats the file system. */
+   If FORMAT is true, reformats the file system, giving every inode
+   the given LAYOUT. */
 void
-filesys_init (bool format) 
+filesys_init (bool format, enum inode_layout layout) 
 {
   fs_device = block_get_role (BLOCK_FILESYS);
   if (fs_device == NULL)
     PANIC ("No file system device found, can't initialize file system.");
 
+  cache_init ();
+  dcache_init ();
   inode_init ();
   free_map_init ();
+  journal_init ();
 
   if (format) 
-    do_format ();
+    do_format (layout);
 
+  /* Committed changes that did not make it home before the last
+     shutdown are put in place before anything is read. */
+  journal_open ();
   free_map_open ();
+
+  /* New inodes use the layout the file system was formatted with,
+     which is the root directory's. */
+  struct inode *root = inode_open (ROOT_DIR_SECTOR);
+  if (root == NULL)
+    PANIC ("can't open root directory");
+  inode_set_default_layout (root->data.layout);
+  inode_close (root);
 }
 
 /* Shuts down the file system module, writing any unwritten data
@@ -35,7 +54,31 @@ filesys_init (bool format)
 void
 filesys_done (void) 
 {
+  inode_flush_all ();
+  inode_reclaim_wait ();
   free_map_close ();
+  journal_close ();
+  cache_flush ();
+}
+
+/* Writes INODE's data and metadata to disk and waits for them to
+   get there. The cache does not know which file a sector belongs
+   to, so this writes out everything dirty, in a pass shared with
+   any other fsync or sync running at the same time. */
+void
+filesys_fsync (struct inode *inode)
+{
+  inode_flush (inode);
+  cache_sync ();
+}
+
+/* Writes every pending change in the file system to disk and
+   waits for them to get there. */
+void
+filesys_sync (void)
+{
+  inode_flush_all ();
+  cache_sync ();
 }
 
 /* Creates a file named NAME with the given INITIAL_SIZE.
@@ -48,12 +91,18 @@ filesys_create (const char *name, off_t initial_size)
   block_sector_t inode_sector = 0;
   struct dir *dir = resolve_path (name, dir_open_root (), NULL, false);
   // struct dir *dir = dir_open_root ();
+  journal_begin ();
   bool success = (dir != NULL
-                  && free_map_allocate (1, &inode_sector)
-                  && inode_create (inode_sector, initial_size, NULL, NULL)
+                  && free_map_allocate_near (1, placement (dir, false),
+                                             &inode_sector)
+                  && inode_create (inode_sector, initial_size,
+                                   INODE_TYPE_FILE, 0)
                   && dir_add (dir, name, inode_sector));
   if (!success && inode_sector != 0) 
     free_map_release (inode_sector, 1);
+  journal_end ();
+  if (success)
+    dir_build_index (dir);
   dir_close (dir);
 
   return success;
@@ -65,12 +114,17 @@ bool
 filesys_create_at_dir (const char *name, off_t initial_size, struct dir *dir, bool isDir)
 {
   block_sector_t inode_sector = 0;
+  journal_begin ();
   bool success = (dir != NULL
-                  && free_map_allocate (1, &inode_sector)
-                  && (isDir ? dir_create (inode_sector, initial_size, dir->inode->sector) : inode_create (inode_sector, initial_size, isDir, dir->inode->sector))
+                  && free_map_allocate_near (1, placement (dir, isDir),
+                                             &inode_sector)
+                  && (isDir ? dir_create (inode_sector, initial_size, dir->inode->sector) : inode_create (inode_sector, initial_size, INODE_TYPE_FILE, dir->inode->sector))
                   && dir_add (dir, name, inode_sector));
   if (!success && inode_sector != 0) 
     free_map_release (inode_sector, 1);
+  journal_end ();
+  if (success)
+    dir_build_index (dir);
   dir_close (dir);
 
   return success;
@@ -123,12 +177,26 @@ filesys_remove_at_dir (const char *name, struct dir *dir)
   return success;
 }
 
-/* Formats the file system. */
+/* Returns the sector a new inode in DIR should be allocated near.
+   Files and subdirectories go in their parent's block group, new
+   top-level directories in the group with the most room. */
+static block_sector_t
+placement (struct dir *dir, bool isDir)
+{
+  block_sector_t parent = inode_get_inumber (dir_get_inode (dir));
+  if (isDir && parent == ROOT_DIR_SECTOR)
+    return free_map_spread ();
+  return parent;
+}
+
+/* Formats the file system, using LAYOUT for all inodes. */
 static void
-do_format (void)
+do_format (enum inode_layout layout)
 {
   printf ("Formatting file system...");
+  inode_set_default_layout (layout);
   free_map_create ();
+  journal_create ();
   if (!dir_create (ROOT_DIR_SECTOR, 16, NULL))
     PANIC ("root directory creation failed");
   free_map_close ();
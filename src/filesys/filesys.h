@@ -3,16 +3,18 @@
 
 #include <stdbool.h>
 #include "filesys/off_t.h"
+#include "filesys/inode.h"
 #include "filesys/directory.h"
 
 /* Sectors of system file inodes. */
 #define FREE_MAP_SECTOR 0       /* Free map file inode sector. */
 #define ROOT_DIR_SECTOR 1       /* Root directory file inode sector. */
+#define JOURNAL_SECTOR 2        /* Journal header sector. */
 
 /* Block device that contains the file system. */
 extern struct block *fs_device;
 
-void filesys_init (bool format);
+void filesys_init (bool format, enum inode_layout layout);
 void filesys_done (void);
 bool filesys_create (const char *name, off_t initial_size);
 bool filesys_create_at_dir (const char *name, off_t initial_size, struct dir *dir, bool isDir);
@@ -21,4 +23,7 @@ struct file *filesys_open (const char *name, struct dir *dir);
 bool filesys_remove (const char *name);
 bool filesys_remove_at_dir (const char *name, struct dir *dir);
 
+void filesys_fsync (struct inode *);
+void filesys_sync (void);
+
 #endif /* filesys/filesys.h */
@@ -1,13 +1,61 @@
 #include "filesys/free-map.h"
 #include <bitmap.h>
 #include <debug.h>
+#include <round.h>
 #include "filesys/file.h"
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
+#include "filesys/journal.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
+
+/* Number of free map bits stored in one sector of the free map
+   file. */
+#define BITS_PER_SECTOR (BLOCK_SECTOR_SIZE * 8)
 
 static struct file *free_map_file;   /* Free map file. */
 static struct bitmap *free_map;      /* Free map, one bit per sector. */
 
+/* Sectors of the free map file changed since they were last
+   written, one bit per sector. */
+static struct bitmap *dirty_map;
+
+/* Free sectors in each block group. */
+static size_t group_cnt;
+static size_t *group_free;
+
+/* Sectors summarized by each leaf of the free space index. */
+#define LEAF_SECTORS 32
+
+/* Node of the free space index, a segment tree over free_map.
+   Each node describes the free runs in its range of sectors. */
+struct free_node
+{
+  uint32_t pre;                 /* Free sectors at the start. */
+  uint32_t suf;                 /* Free sectors at the end. */
+  uint32_t best;                /* Longest run of free sectors. */
+};
+
+/* The free space index. Node 1 is the root, node N has children
+   2N and 2N + 1, and the LEAF_CNT leaves, LEAF_SECTORS sectors
+   each, come last. Sectors past the end of the disk count as
+   used. */
+static struct free_node *tree;
+static size_t leaf_cnt;
+
+/* Protects free_map, dirty_map, group_free, tree and
+   free_map_file. */
+static struct lock free_map_lock;
+
+static bool allocate (size_t, block_sector_t start, block_sector_t *);
+static void count_groups (void);
+static void account (block_sector_t, size_t, bool used);
+static void tree_build (void);
+static void tree_update (block_sector_t, size_t);
+static size_t tree_find (size_t start, size_t cnt);
+static void mark_dirty (block_sector_t, size_t);
+static void write_dirty (void);
+
 /* Initializes the free map. */
 void
 free_map_init (void) 
@@ -17,36 +65,139 @@ free_map_init (void)
     PANIC ("bitmap creation failed--file system device is too large");
   bitmap_mark (free_map, FREE_MAP_SECTOR);
   bitmap_mark (free_map, ROOT_DIR_SECTOR);
+  bitmap_mark (free_map, JOURNAL_SECTOR);
+
+  lock_init (&free_map_lock);
+  dirty_map = bitmap_create (DIV_ROUND_UP (bitmap_size (free_map),
+                                           BITS_PER_SECTOR));
+  if (dirty_map == NULL)
+    PANIC ("bitmap creation failed--file system device is too large");
+
+  group_cnt = DIV_ROUND_UP (bitmap_size (free_map), BLOCK_GROUP_SECTORS);
+  group_free = malloc (group_cnt * sizeof *group_free);
+  if (group_free == NULL)
+    PANIC ("can't allocate block group counts");
+  count_groups ();
+
+  leaf_cnt = 1;
+  while (leaf_cnt * LEAF_SECTORS < bitmap_size (free_map))
+    leaf_cnt *= 2;
+  tree = malloc (2 * leaf_cnt * sizeof *tree);
+  if (tree == NULL)
+    PANIC ("can't allocate free space index");
+  tree_build ();
 }
 
 /* Allocates CNT consecutive sectors from the free map and stores
    the first into *SECTORP.
    Returns true if successful, false if not enough consecutive
-   sectors were available or if the free_map file could not be
-   written. */
+   sectors were available. */
 bool
 free_map_allocate (size_t cnt, block_sector_t *sectorp)
 {
-  block_sector_t sector = bitmap_scan_and_flip (free_map, 0, cnt, false);
-  if (sector != BITMAP_ERROR
-      && free_map_file != NULL
-      && !bitmap_write (free_map, free_map_file))
+  return allocate (cnt, 0, sectorp);
+}
+
+/* Allocates CNT consecutive sectors like free_map_allocate(), from
+   the block group holding sector NEAR if there is room there, or
+   else as close after it as possible. */
+bool
+free_map_allocate_near (size_t cnt, block_sector_t near,
+                        block_sector_t *sectorp)
+{
+  if (near >= bitmap_size (free_map))
+    near = 0;
+  return allocate (cnt, near / BLOCK_GROUP_SECTORS * BLOCK_GROUP_SECTORS,
+                   sectorp);
+}
+
+/* Returns the first sector of the block group with the most free
+   sectors, for placing something unrelated to what is already on
+   disk, such as a new top-level directory, so that those spread
+   out and leave room to grow in their groups. */
+block_sector_t
+free_map_spread (void)
+{
+  size_t best = 0;
+
+  lock_acquire (&free_map_lock);
+  for (size_t g = 1; g < group_cnt; g++)
+    if (group_free[g] > group_free[best])
+      best = g;
+  lock_release (&free_map_lock);
+  return best * BLOCK_GROUP_SECTORS;
+}
+
+/* Allocates the CNT consecutive sectors starting at SECTOR, if
+   they are all free.
+   Returns true if successful, false if any of them is in use. */
+bool
+free_map_allocate_at (block_sector_t sector, size_t cnt)
+{
+  bool success = false;
+
+  journal_begin ();
+  lock_acquire (&free_map_lock);
+  if (sector + cnt <= bitmap_size (free_map)
+      && bitmap_none (free_map, sector, cnt))
     {
-      bitmap_set_multiple (free_map, sector, cnt, false); 
-      sector = BITMAP_ERROR;
+      bitmap_set_multiple (free_map, sector, cnt, true);
+      account (sector, cnt, true);
+      tree_update (sector, cnt);
+      mark_dirty (sector, cnt);
+      write_dirty ();
+      success = true;
     }
-  if (sector != BITMAP_ERROR)
-    *sectorp = sector;
-  return sector != BITMAP_ERROR;
+  lock_release (&free_map_lock);
+  journal_end ();
+  return success;
 }
 
 /* Makes CNT sectors starting at SECTOR available for use. */
 void
 free_map_release (block_sector_t sector, size_t cnt)
 {
-  ASSERT (bitmap_all (free_map, sector, cnt));
-  bitmap_set_multiple (free_map, sector, cnt, false);
-  bitmap_write (free_map, free_map_file);
+  struct free_run run = { sector, cnt };
+  free_map_release_runs (&run, 1);
+}
+
+/* Makes the RUN_CNT runs of sectors in RUNS available for use, in
+   a single update of the free map file. */
+void
+free_map_release_runs (const struct free_run *runs, size_t run_cnt)
+{
+  journal_begin ();
+  lock_acquire (&free_map_lock);
+  for (size_t i = 0; i < run_cnt; i++)
+    {
+      block_sector_t sector = runs[i].start;
+      size_t cnt = runs[i].cnt;
+
+      ASSERT (bitmap_all (free_map, sector, cnt));
+      bitmap_set_multiple (free_map, sector, cnt, false);
+      account (sector, cnt, false);
+      tree_update (sector, cnt);
+      mark_dirty (sector, cnt);
+    }
+  write_dirty ();
+  lock_release (&free_map_lock);
+  journal_end ();
+}
+
+/* Writes the sectors of the free map file that changed since they
+   were last written. Does nothing before the free map file is
+   open. */
+void
+free_map_flush (void)
+{
+  if (dirty_map == NULL)
+    return;
+
+  journal_begin ();
+  lock_acquire (&free_map_lock);
+  write_dirty ();
+  lock_release (&free_map_lock);
+  journal_end ();
 }
 
 /* Opens the free map file and reads it from disk. */
@@ -58,13 +209,23 @@ free_map_open (void)
     PANIC ("can't open free map");
   if (!bitmap_read (free_map, free_map_file))
     PANIC ("can't read free map");
+
+  lock_acquire (&free_map_lock);
+  count_groups ();
+  tree_build ();
+  lock_release (&free_map_lock);
 }
 
 /* Writes the free map to disk and closes the free map file. */
 void
 free_map_close (void) 
 {
+  free_map_flush ();
+
+  lock_acquire (&free_map_lock);
   file_close (free_map_file);
+  free_map_file = NULL;
+  lock_release (&free_map_lock);
 }
 
 /* Creates a new free map file on disk and writes the free map to
@@ -73,13 +234,319 @@ void
 free_map_create (void) 
 {
   /* Create inode. */
-  if (!inode_create (FREE_MAP_SECTOR, bitmap_file_size (free_map), NULL, NULL))
+  if (!inode_create (FREE_MAP_SECTOR, bitmap_file_size (free_map),
+                     INODE_TYPE_FILE, 0))
     PANIC ("free map creation failed");
 
   /* Write bitmap to file. */
-  free_map_file = file_open (inode_open (FREE_MAP_SECTOR));
-  if (free_map_file == NULL)
+  struct file *file = file_open (inode_open (FREE_MAP_SECTOR));
+  if (file == NULL)
     PANIC ("can't open free map");
-  if (!bitmap_write (free_map, free_map_file))
+  /* Writing the file allocates its sectors, which marks the parts
+     of the map already written dirty again. Allocations do not
+     write the map themselves until free_map_file is set. */
+  bitmap_set_all (dirty_map, false);
+  if (!bitmap_write (free_map, file))
     PANIC ("can't write free map");
+  free_map_file = file;
+}
+
+/* Allocates CNT consecutive sectors, taking the first free run at
+   or after START, or failing that the first one on the disk, and
+   stores the first sector into *SECTORP.
+   Returns true if successful. */
+static bool
+allocate (size_t cnt, block_sector_t start, block_sector_t *sectorp)
+{
+  journal_begin ();
+  lock_acquire (&free_map_lock);
+  block_sector_t sector = tree_find (start, cnt);
+  if (sector == BITMAP_ERROR && start > 0)
+    sector = tree_find (0, cnt);
+  if (sector != BITMAP_ERROR)
+    {
+      bitmap_set_multiple (free_map, sector, cnt, true);
+      account (sector, cnt, true);
+      tree_update (sector, cnt);
+      mark_dirty (sector, cnt);
+      write_dirty ();
+      *sectorp = sector;
+    }
+  lock_release (&free_map_lock);
+  journal_end ();
+  return sector != BITMAP_ERROR;
+}
+
+/* Counts the free sectors of every block group from scratch.
+   Caller must hold free_map_lock, or be initializing. */
+static void
+count_groups (void)
+{
+  size_t size = bitmap_size (free_map);
+
+  for (size_t g = 0; g < group_cnt; g++)
+    {
+      size_t start = g * BLOCK_GROUP_SECTORS;
+      size_t cnt = size - start < BLOCK_GROUP_SECTORS
+                   ? size - start : BLOCK_GROUP_SECTORS;
+      group_free[g] = bitmap_count (free_map, start, cnt, false);
+    }
+}
+
+/* Updates the free counts of the block groups holding the CNT
+   sectors starting at SECTOR, which just became used if USED is
+   true or free otherwise.
+   Caller must hold free_map_lock. */
+static void
+account (block_sector_t sector, size_t cnt, bool used)
+{
+  while (cnt > 0)
+    {
+      size_t g = sector / BLOCK_GROUP_SECTORS;
+      size_t n = (g + 1) * BLOCK_GROUP_SECTORS - sector;
+      if (n > cnt)
+        n = cnt;
+
+      if (used)
+        group_free[g] -= n;
+      else
+        group_free[g] += n;
+      sector += n;
+      cnt -= n;
+    }
+}
+
+/* Marks the free map file sectors holding the bits for the CNT
+   sectors starting at SECTOR as changed.
+   Caller must hold free_map_lock. */
+static void
+mark_dirty (block_sector_t sector, size_t cnt)
+{
+  if (cnt == 0)
+    return;
+
+  size_t first = sector / BITS_PER_SECTOR;
+  size_t last = (sector + cnt - 1) / BITS_PER_SECTOR;
+  bitmap_set_multiple (dirty_map, first, last - first + 1, true);
+}
+
+/* Writes the sectors of the free map file that changed since they
+   were last written. Every allocation and release calls this, so
+   the change goes into the same journal transaction as whatever
+   the sectors were allocated or released for. Each run of
+   adjacent changed sectors goes out in a single write.
+   Caller must hold free_map_lock. */
+static void
+write_dirty (void)
+{
+  if (free_map_file == NULL)
+    return;
+
+  size_t start = 0;
+  while ((start = bitmap_scan (dirty_map, start, 1, true)) != BITMAP_ERROR)
+    {
+      size_t end = bitmap_scan (dirty_map, start, 1, false);
+      if (end == BITMAP_ERROR)
+        end = bitmap_size (dirty_map);
+
+      /* Leave the run marked dirty if it could not be written. */
+      if (bitmap_write_partial (free_map, free_map_file,
+                                start * BLOCK_SECTOR_SIZE,
+                                (end - start) * BLOCK_SECTOR_SIZE))
+        bitmap_set_multiple (dirty_map, start, end - start, false);
+      start = end;
+    }
+}
+
+/* FREE SPACE INDEX */
+
+/* Recomputes leaf LEAF of the free space index from free_map. */
+static void
+tree_leaf (size_t leaf)
+{
+  struct free_node *node = &tree[leaf_cnt + leaf];
+  size_t size = bitmap_size (free_map);
+  uint32_t run = 0;
+  bool leading = true;
+
+  node->pre = node->best = 0;
+  for (size_t i = 0; i < LEAF_SECTORS; i++)
+    {
+      size_t sector = leaf * LEAF_SECTORS + i;
+      if (sector < size && !bitmap_test (free_map, sector))
+        {
+          if (++run > node->best)
+            node->best = run;
+        }
+      else
+        {
+          if (leading)
+            node->pre = run;
+          leading = false;
+          run = 0;
+        }
+    }
+  if (leading)
+    node->pre = run;
+  node->suf = run;
+}
+
+/* Recomputes inner node N of the free space index from its
+   children, which cover LEN sectors each. */
+static void
+tree_pull (size_t n, uint32_t len)
+{
+  const struct free_node *l = &tree[2 * n];
+  const struct free_node *r = &tree[2 * n + 1];
+  struct free_node *node = &tree[n];
+
+  node->pre = l->pre == len ? len + r->pre : l->pre;
+  node->suf = r->suf == len ? len + l->suf : r->suf;
+  node->best = l->best > r->best ? l->best : r->best;
+  if (l->suf + r->pre > node->best)
+    node->best = l->suf + r->pre;
+}
+
+/* Builds the free space index from free_map. */
+static void
+tree_build (void)
+{
+  for (size_t leaf = 0; leaf < leaf_cnt; leaf++)
+    tree_leaf (leaf);
+
+  uint32_t len = LEAF_SECTORS;
+  for (size_t first = leaf_cnt / 2; first >= 1; first /= 2)
+    {
+      for (size_t n = first; n < 2 * first; n++)
+        tree_pull (n, len);
+      len *= 2;
+    }
+}
+
+/* Brings the free space index up to date after the CNT sectors
+   starting at SECTOR changed in free_map. Takes time linear in
+   the number of leaves they span plus the height of the tree. */
+static void
+tree_update (block_sector_t sector, size_t cnt)
+{
+  if (cnt == 0)
+    return;
+
+  size_t lo = sector / LEAF_SECTORS;
+  size_t hi = (sector + cnt - 1) / LEAF_SECTORS;
+  for (size_t leaf = lo; leaf <= hi; leaf++)
+    tree_leaf (leaf);
+
+  uint32_t len = LEAF_SECTORS;
+  for (lo += leaf_cnt, hi += leaf_cnt; lo > 1; len *= 2)
+    {
+      lo /= 2;
+      hi /= 2;
+      for (size_t n = lo; n <= hi; n++)
+        tree_pull (n, len);
+    }
+}
+
+/* Returns the first sector of the leftmost run of CNT free
+   sectors within node N, which covers LEN sectors starting at LO,
+   or BITMAP_ERROR if there is none. CARRY free sectors right
+   before LO count as the start of a run. Descends a single path,
+   since a child is only entered once it is known to hold the
+   run. */
+static size_t
+find_in (size_t n, size_t lo, size_t len, size_t carry, size_t cnt)
+{
+  while (n < leaf_cnt)
+    {
+      const struct free_node *l = &tree[2 * n];
+      const struct free_node *r = &tree[2 * n + 1];
+      size_t half = len / 2;
+
+      if (carry + l->pre >= cnt || l->best >= cnt)
+        {
+          n = 2 * n;
+          len = half;
+          continue;
+        }
+      carry = l->pre == half ? carry + half : l->suf;
+      if (carry + r->pre >= cnt)
+        return lo + half - carry;
+      if (r->best < cnt)
+        return BITMAP_ERROR;
+      n = 2 * n + 1;
+      lo += half;
+      len = half;
+    }
+
+  /* A leaf: look at its sectors one at a time. */
+  size_t size = bitmap_size (free_map);
+  for (size_t i = 0; i < len; i++)
+    {
+      if (lo + i < size && !bitmap_test (free_map, lo + i))
+        {
+          if (++carry >= cnt)
+            return lo + i + 1 - cnt;
+        }
+      else
+        carry = 0;
+    }
+  return BITMAP_ERROR;
+}
+
+/* Like find_in(), but only considers runs starting at or after
+   sector START, and updates *CARRY to the free sectors at the end
+   of node N from START on when there is no run. */
+static size_t
+find_from (size_t n, size_t lo, size_t len, size_t start, size_t *carry,
+           size_t cnt)
+{
+  if (lo + len <= start)
+    return BITMAP_ERROR;
+
+  /* Wholly after START: answer from the summary. */
+  if (lo >= start)
+    {
+      const struct free_node *node = &tree[n];
+      if (*carry + node->pre >= cnt || node->best >= cnt)
+        return find_in (n, lo, len, *carry, cnt);
+      *carry = node->pre == len ? *carry + len : node->suf;
+      return BITMAP_ERROR;
+    }
+
+  /* START falls inside a leaf: look at the sectors from START. */
+  if (n >= leaf_cnt)
+    {
+      size_t size = bitmap_size (free_map);
+      for (size_t sector = start; sector < lo + len; sector++)
+        {
+          if (sector < size && !bitmap_test (free_map, sector))
+            {
+              if (++*carry >= cnt)
+                return sector + 1 - cnt;
+            }
+          else
+            *carry = 0;
+        }
+      return BITMAP_ERROR;
+    }
+
+  size_t sector = find_from (2 * n, lo, len / 2, start, carry, cnt);
+  if (sector == BITMAP_ERROR)
+    sector = find_from (2 * n + 1, lo + len / 2, len / 2, start, carry, cnt);
+  return sector;
+}
+
+/* Returns the first sector of the leftmost run of CNT free
+   sectors starting at or after sector START, or BITMAP_ERROR if
+   there is none. Visits O(log n) nodes: the path down to START,
+   and at most one path down to the run.
+   Caller must hold free_map_lock. */
+static size_t
+tree_find (size_t start, size_t cnt)
+{
+  size_t carry = 0;
+
+  if (cnt == 0)
+    return start < bitmap_size (free_map) ? start : BITMAP_ERROR;
+  return find_from (1, 0, leaf_cnt * LEAF_SECTORS, start, &carry, cnt);
 }
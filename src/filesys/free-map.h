@@ -5,6 +5,19 @@
 #include <stddef.h>
 #include "devices/block.h"
 
+/* Sectors per block group. Related sectors, such as a file's
+   inode and data or the files of one directory, are allocated
+   within one group where they fit, so that they end up close
+   together on disk. */
+#define BLOCK_GROUP_SECTORS 512
+
+/* A run of CNT sectors starting at START. */
+struct free_run
+  {
+    block_sector_t start;
+    size_t cnt;
+  };
+
 void free_map_init (void);
 void free_map_read (void);
 void free_map_create (void);
@@ -12,6 +25,11 @@ void free_map_open (void);
 void free_map_close (void);
 
 bool free_map_allocate (size_t, block_sector_t *);
+bool free_map_allocate_near (size_t, block_sector_t near, block_sector_t *);
+block_sector_t free_map_spread (void);
+bool free_map_allocate_at (block_sector_t, size_t);
 void free_map_release (block_sector_t, size_t);
+void free_map_release_runs (const struct free_run *, size_t run_cnt);
+void free_map_flush (void);
 
 #endif /* filesys/free-map.h */
@@ -2,37 +2,131 @@
 #include <debug.h>
 #include <round.h>
 #include <string.h>
+#include "filesys/cache.h"
 #include "filesys/filesys.h"
 #include "filesys/free-map.h"
+#include "filesys/journal.h"
 #include "threads/malloc.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
 #include "lib/stdlib.h"
 
 /* Identifies an inode. */
 #define INODE_MAGIC 0x494e4f44
 
-/* List of open inodes, so that opening a single inode twice
-   returns the same `struct inode'. */
-static struct list open_inodes;
+/* Read-ahead window bounds, in sectors. The window starts at
+   READAHEAD_MIN on the first sequential read and doubles on every
+   following one up to READAHEAD_MAX. */
+#define READAHEAD_MIN 2
+#define READAHEAD_MAX 16
 
-/* HELPERS */
+/* Extents per extent leaf block and leaf blocks per extent index
+   block, chosen so that both fill exactly one sector. */
+#define EXTENT_LEAF_CNT 42
+#define EXTENT_INDEX_CNT 63
 
-/* Returns the sector index stored in an indirect block, -1 if invalid */
-block_sector_t
-indirect_sector_lookup(block_sector_t sector, uint32_t offset)
+/* Extent leaf block: holds the extents of a file that did not fit
+   in its inode, in file order. */
+struct extent_leaf
 {
-  ASSERT(offset < 128 && offset >= 0);
+  uint32_t cnt;                             /* Extents in use. */
+  struct extent extents[EXTENT_LEAF_CNT];
+  uint32_t unused;
+};
 
-  /* 128 * 4 byte numbers = 512 bytes */
-  block_sector_t *data = malloc(BLOCK_SECTOR_SIZE);
-  if (!data)
+/* Extent index block: the root of an extent file's leaf blocks. */
+struct extent_index
+{
+  uint32_t cnt;                             /* Leaves in use. */
+  uint32_t unused;
+  struct
   {
-    PANIC(">> malloc failed to allocate 512 bytes");
+    uint32_t logical;                       /* First file sector in the leaf. */
+    block_sector_t leaf;                    /* Sector of the leaf block. */
+  } leaves[EXTENT_INDEX_CNT];
+};
+
+/* Sectors being handed back to the free map, gathered into runs
+   so that a whole file goes back in a few free map updates. */
+#define RELEASE_BATCH_RUNS 64
+struct release_batch
+{
+  size_t cnt;                               /* Runs in use. */
+  struct free_run runs[RELEASE_BATCH_RUNS];
+};
+
+/* Removed files with more data than this have their sectors
+   released by the reclaim thread, so closing them is quick. */
+#define RECLAIM_MIN_SIZE (64 * BLOCK_SECTOR_SIZE)
+
+/* A removed inode waiting for the reclaim thread. */
+struct reclaim
+{
+  struct list_elem elem;                    /* Element in reclaim_list. */
+  block_sector_t sector;                    /* The inode's own sector. */
+  struct inode_disk data;                   /* Copy of its on-disk inode. */
+};
+
+/* Removed inodes whose sectors have yet to be released, oldest
+   first. */
+static struct list reclaim_list;
+static struct lock reclaim_lock;            /* Protects the list and reclaim_busy. */
+static struct condition reclaim_ready;      /* Signaled when an inode is queued. */
+static struct condition reclaim_idle;       /* Signaled when the list runs dry. */
+static bool reclaim_busy;                   /* The thread is releasing one. */
+
+/* Open inodes keyed by sector, so that opening a single inode
+   twice returns the same `struct inode'. */
+static struct hash open_inodes;
+
+/* Protects open_inodes and the open_cnt of every open inode. */
+static struct lock open_inodes_lock;
+
+/* Number of sectors reserved at a time for a growing file. */
+#define PREALLOC_SECTORS 16
+
+/* Most sectors inode_write_at() writes under one journal handle.
+   With the blocks and free map sectors allocating them touches
+   and the inode itself, they stay within JOURNAL_HANDLE_MAX. */
+#define WRITE_CHUNK_SECTORS 4
+
+/* Layout given to newly created inodes. */
+static enum inode_layout default_layout = INODE_LAYOUT_INDEXED;
+
+static block_sector_t index_to_sector(struct inode *, block_sector_t);
+static bool reclaim_later(struct inode *);
+static off_t write_chunk(struct inode *, const uint8_t *, off_t, off_t);
+static void reclaim_worker(void *);
+static uint32_t extent_leaf_for(const struct extent_index *, block_sector_t);
+
+/* HELPERS */
+
+/* Returns the sector index stored at OFFSET of index block SECTOR,
+   -1 if invalid. *MAP is the inode's in-memory copy of that index
+   block, read in through the cache on first use so later lookups
+   never touch the disk or the cache. */
+static block_sector_t
+indirect_sector_lookup(block_sector_t **map, block_sector_t sector, uint32_t offset)
+{
+  ASSERT(offset < 128);
+
+  /* Index block not allocated yet */
+  if (sector == 0)
     return -1;
+
+  if (*map == NULL)
+  {
+    /* 128 * 4 byte numbers = 512 bytes */
+    *map = malloc(BLOCK_SECTOR_SIZE);
+    if (*map == NULL)
+    {
+      PANIC(">> malloc failed to allocate 512 bytes");
+      return -1;
+    }
+    cache_read (sector, *map);
   }
 
-  block_read(fs_device, sector, data);
-  block_sector_t found_index = data[offset];
-  free(data);
+  block_sector_t found_index = (*map)[offset];
 
   /* We can use 0 to determine whether it is a valid sector 
   since 0 is reserved and it tells us this part hasn't been
@@ -40,22 +134,472 @@ indirect_sector_lookup(block_sector_t sector, uint32_t offset)
   return (found_index == 0) ? -1 : found_index;
 }
 
+/* Keeps INODE's in-memory copies of its index blocks in step after
+   index block SECTOR has been rewritten with BUFFER. INODE may be
+   null for an inode that is not open yet. */
+static void
+index_map_update(struct inode *inode, block_sector_t sector,
+                 const block_sector_t *buffer)
+{
+  if (inode == NULL)
+    return;
+
+  if (sector == inode->data.data_blocks[10])
+  {
+    if (inode->indirect_map != NULL)
+      memcpy(inode->indirect_map, buffer, BLOCK_SECTOR_SIZE);
+  }
+  else if (sector == inode->data.data_blocks[11])
+  {
+    if (inode->dbl_indirect_map != NULL)
+      memcpy(inode->dbl_indirect_map, buffer, BLOCK_SECTOR_SIZE);
+  }
+  else if (inode->dbl_indirect_map != NULL && inode->dbl_leaf_maps != NULL)
+  {
+    for (int i = 0; i < 128; i++)
+    {
+      if (inode->dbl_indirect_map[i] == sector)
+      {
+        if (inode->dbl_leaf_maps[i] != NULL)
+          memcpy(inode->dbl_leaf_maps[i], buffer, BLOCK_SECTOR_SIZE);
+        break;
+      }
+    }
+  }
+}
+
+/* Frees INODE's in-memory copies of its index blocks. */
+static void
+index_map_free(struct inode *inode)
+{
+  free(inode->indirect_map);
+  free(inode->dbl_indirect_map);
+  if (inode->dbl_leaf_maps != NULL)
+  {
+    for (int i = 0; i < 128; i++)
+      free(inode->dbl_leaf_maps[i]);
+    free(inode->dbl_leaf_maps);
+  }
+  inode->indirect_map = NULL;
+  inode->dbl_indirect_map = NULL;
+  inode->dbl_leaf_maps = NULL;
+}
+
+/* RELEASE */
+
+/* Hands the runs gathered in BATCH back to the free map. */
+static void
+batch_flush(struct release_batch *batch)
+{
+  if (batch->cnt > 0)
+    free_map_release_runs(batch->runs, batch->cnt);
+  batch->cnt = 0;
+}
+
+/* Adds the CNT sectors starting at SECTOR to BATCH, extending the
+   last run when they follow right after it. */
+static void
+batch_add(struct release_batch *batch, block_sector_t sector, size_t cnt)
+{
+  if (batch->cnt > 0)
+  {
+    struct free_run *last = &batch->runs[batch->cnt - 1];
+    if (last->start + last->cnt == sector)
+    {
+      last->cnt += cnt;
+      return;
+    }
+  }
+
+  if (batch->cnt == RELEASE_BATCH_RUNS)
+    batch_flush(batch);
+  batch->runs[batch->cnt].start = sector;
+  batch->runs[batch->cnt].cnt = cnt;
+  batch->cnt++;
+}
+
+/* PREALLOCATION */
+
+/* Reserves a run of up to WANT contiguous free sectors into empty
+   WINDOW, preferring one that starts at HINT if HINT is not 0,
+   then one in the block group of the window's home sector.
+   Settles for shorter runs when no run that long is free.
+   Returns true if anything was reserved. */
+static bool
+prealloc_reserve(struct prealloc *window, size_t want, block_sector_t hint)
+{
+  ASSERT(window->cnt == 0);
+
+  for (size_t cnt = want; cnt > 0; cnt /= 2)
+  {
+    if (hint != 0 && free_map_allocate_at(hint, cnt))
+      window->start = hint;
+    else if (!free_map_allocate_near(cnt, window->home, &window->start))
+      continue;
+    window->cnt = cnt;
+    return true;
+  }
+
+  /* The disk may only look full because removed files are still
+     being released */
+  if (inode_reclaim_wait())
+    return prealloc_reserve(window, want, hint);
+  return false;
+}
+
+/* Hands the sectors left in WINDOW back to the free map. */
+static void
+prealloc_release(struct prealloc *window)
+{
+  if (window->cnt > 0)
+    free_map_release(window->start, window->cnt);
+  window->cnt = 0;
+}
+
+/* Writes SIZE bytes from BUFFER to data sector SECTOR, starting
+   OFS bytes into it. A sector the journal may still hold an older
+   image of, from when it was metadata, is written through the
+   journal, or replaying that image would undo the write. */
+static void
+data_write_at(block_sector_t sector, const void *buffer, off_t ofs,
+              off_t size)
+{
+  if (journal_holds(sector))
+    journal_write_at (sector, buffer, ofs, size);
+  else
+    cache_write_at (sector, buffer, ofs, size);
+}
+
+/* Takes the next sector of WINDOW for file data, refilling WINDOW
+   with PREALLOC_SECTORS contiguous sectors when it is empty, and
+   stores it in *SECTORP. Zeros the sector if ZERO is true.
+   Returns true if successful, false if the disk is full. */
+static bool
+allocate_data_sector(struct prealloc *window, bool zero, block_sector_t *sectorp)
+{
+  if (window->cnt == 0 && !prealloc_reserve(window, PREALLOC_SECTORS, 0))
+    return false;
+
+  *sectorp = window->start++;
+  window->cnt--;
+
+  if (zero)
+  {
+    static const uint8_t zero_buffer[BLOCK_SECTOR_SIZE];
+    data_write_at (*sectorp, zero_buffer, 0, BLOCK_SECTOR_SIZE);
+  }
+  return true;
+}
+
+/* EXTENTS */
+
+/* Returns true if file sector IDX falls inside extent E. */
+static inline bool
+extent_contains(const struct extent *e, block_sector_t idx)
+{
+  return e->length > 0 && idx >= e->logical && idx - e->logical < e->length;
+}
+
+/* Searches the CNT extents in EXTENTS for file sector IDX. Copies
+   the extent holding it into *FOUND and returns true, or returns
+   false if none does. */
+static bool
+extent_search(const struct extent *extents, uint32_t cnt, block_sector_t idx,
+              struct extent *found)
+{
+  for (uint32_t i = 0; i < cnt; i++)
+  {
+    if (extent_contains(&extents[i], idx))
+    {
+      *found = extents[i];
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Searches extent based DISK for the extent holding file sector
+   IDX, first in the inode, then in the one extent block that can
+   hold it. Copies it into *FOUND and returns true, or returns
+   false if IDX is in a hole. */
+static bool
+extent_find(const struct inode_disk *disk, block_sector_t idx,
+            struct extent *found)
+{
+  if (extent_search(disk->extents, disk->extent_cnt, idx, found))
+    return true;
+  if (disk->extent_index == 0)
+    return false;
+
+  struct extent_index *index = malloc(BLOCK_SECTOR_SIZE);
+  struct extent_leaf *leaf = malloc(BLOCK_SECTOR_SIZE);
+  bool success = false;
+  if (index != NULL && leaf != NULL)
+  {
+    cache_read (disk->extent_index, index);
+    if (index->cnt > 0)
+    {
+      cache_read (index->leaves[extent_leaf_for(index, idx)].leaf, leaf);
+      success = extent_search(leaf->extents, leaf->cnt, idx, found);
+    }
+  }
+  free(index);
+  free(leaf);
+  return success;
+}
+
+/* Returns the disk sector holding file sector IDX of extent based
+   INODE, -1 if none. Sequential access keeps hitting the extent
+   used by the previous lookup, which is remembered in INODE. */
+static block_sector_t
+extent_lookup(struct inode *inode, block_sector_t idx)
+{
+  struct extent found;
+
+  if (extent_contains(&inode->extent_hint, idx))
+    found = inode->extent_hint;
+  else if (!extent_find(&inode->data, idx, &found))
+    return -1;
+
+  inode->extent_hint = found;
+  return found.start + (idx - found.logical);
+}
+
+/* Returns the position in INDEX of the extent block that holds, or
+   would hold, the extent for file sector IDX: the last one starting
+   at or before IDX, or the first one if none does.
+   Each extent block only holds extents starting between where it
+   starts and where the next one starts. */
+static uint32_t
+extent_leaf_for(const struct extent_index *index, block_sector_t idx)
+{
+  uint32_t i = index->cnt - 1;
+  while (i > 0 && index->leaves[i].logical > idx)
+    i--;
+  return i;
+}
+
+/* Grows the extent of DISK starting at file sector LOGICAL by one
+   sector. Returns true if successful, false if there is no such
+   extent or out of memory. */
+static bool
+extent_grow(struct inode_disk *disk, block_sector_t logical)
+{
+  for (uint32_t i = 0; i < disk->extent_cnt; i++)
+  {
+    if (disk->extents[i].logical == logical)
+    {
+      disk->extents[i].length++;
+      return true;
+    }
+  }
+  if (disk->extent_index == 0)
+    return false;
+
+  struct extent_index *index = malloc(BLOCK_SECTOR_SIZE);
+  struct extent_leaf *leaf = malloc(BLOCK_SECTOR_SIZE);
+  bool success = false;
+  if (index != NULL && leaf != NULL)
+  {
+    cache_read (disk->extent_index, index);
+    block_sector_t leaf_sector = index->leaves[extent_leaf_for(index, logical)].leaf;
+    cache_read (leaf_sector, leaf);
+    for (uint32_t i = 0; i < leaf->cnt; i++)
+    {
+      if (leaf->extents[i].logical == logical)
+      {
+        leaf->extents[i].length++;
+        journal_write (leaf_sector, leaf);
+        success = true;
+        break;
+      }
+    }
+  }
+  free(index);
+  free(leaf);
+  return success;
+}
+
+/* Adds extent E, which must not overlap any other, to DISK. It
+   goes in the inode while there is room, and after that in the
+   extent block covering it, which is split in two when full.
+   Returns true if successful, false if out of memory or disk. */
+static bool
+extent_insert(struct inode_disk *disk, const struct extent *e)
+{
+  if (disk->extent_cnt < INODE_EXTENT_CNT)
+  {
+    disk->extents[disk->extent_cnt++] = *e;
+    return true;
+  }
+
+  struct extent_index *index = malloc(BLOCK_SECTOR_SIZE);
+  struct extent_leaf *leaf = malloc(BLOCK_SECTOR_SIZE);
+  struct extent_leaf *split = malloc(BLOCK_SECTOR_SIZE);
+  bool success = false;
+  block_sector_t leaf_sector = 0;
+  if (index == NULL || leaf == NULL || split == NULL)
+    goto done;
+
+  /* Special case where the index block needs to be set up */
+  if (disk->extent_index == 0)
+  {
+    if (!free_map_allocate_near(1, e->start, &disk->extent_index))
+    {
+      disk->extent_index = 0;
+      goto done;
+    }
+    memset(index, 0, BLOCK_SECTOR_SIZE);
+  }
+  else
+    cache_read (disk->extent_index, index);
+
+  uint32_t i = 0;
+  if (index->cnt > 0)
+  {
+    i = extent_leaf_for(index, e->logical);
+    leaf_sector = index->leaves[i].leaf;
+    cache_read (leaf_sector, leaf);
+  }
+
+  /* Room in the covering block */
+  if (index->cnt > 0 && leaf->cnt < EXTENT_LEAF_CNT)
+  {
+    leaf->extents[leaf->cnt++] = *e;
+    journal_write (leaf_sector, leaf);
+    if (e->logical < index->leaves[i].logical)
+    {
+      index->leaves[i].logical = e->logical;
+      journal_write (disk->extent_index, index);
+    }
+    success = true;
+    goto done;
+  }
+
+  /* Start a new block. It takes over the extents of the covering
+     block that start after E, if E belongs in that block at all. */
+  if (index->cnt == EXTENT_INDEX_CNT
+      || !free_map_allocate_near(1, e->start, &leaf_sector))
+  {
+    if (index->cnt == 0)
+    {
+      free_map_release(disk->extent_index, 1);
+      disk->extent_index = 0;
+    }
+    goto done;
+  }
+  memset(split, 0, BLOCK_SECTOR_SIZE);
+  if (index->cnt > 0 && e->logical >= index->leaves[i].logical)
+  {
+    uint32_t kept = 0;
+    for (uint32_t j = 0; j < leaf->cnt; j++)
+    {
+      if (leaf->extents[j].logical > e->logical)
+        split->extents[split->cnt++] = leaf->extents[j];
+      else
+        leaf->extents[kept++] = leaf->extents[j];
+    }
+    leaf->cnt = kept;
+    journal_write (index->leaves[i].leaf, leaf);
+    i++;
+  }
+  split->extents[split->cnt++] = *e;
+  journal_write (leaf_sector, split);
+
+  memmove(&index->leaves[i + 1], &index->leaves[i],
+          (index->cnt - i) * sizeof index->leaves[0]);
+  index->leaves[i].logical = e->logical;
+  index->leaves[i].leaf = leaf_sector;
+  index->cnt++;
+  journal_write (disk->extent_index, index);
+  success = true;
+
+ done:
+  free(index);
+  free(leaf);
+  free(split);
+  return success;
+}
+
+/* Extent layout version of allocate_sector_at(). Grows the extent
+   ending right before file sector IDX when the sector taken from
+   WINDOW comes right after it on disk too, so that a file written
+   sequentially ends up as a handful of long runs. */
+static block_sector_t
+extent_allocate_at(struct inode_disk *disk, struct prealloc *window,
+                   block_sector_t idx, bool zero)
+{
+  struct extent prev;
+  bool has_prev = idx > 0 && extent_find(disk, idx - 1, &prev);
+  block_sector_t sector;
+
+  /* With an empty window, try to carry on right after that run */
+  if (has_prev && window->cnt == 0)
+    prealloc_reserve(window, PREALLOC_SECTORS,
+                     prev.start + (idx - prev.logical));
+
+  if (!allocate_data_sector(window, zero, &sector))
+    return -1;
+
+  if (has_prev && prev.logical + prev.length == idx
+      && sector == prev.start + prev.length
+      && extent_grow(disk, prev.logical))
+    return sector;
+
+  struct extent e;
+  e.logical = idx;
+  e.start = sector;
+  e.length = 1;
+  if (!extent_insert(disk, &e))
+  {
+    /* Hand the sector back to the window it was taken from */
+    window->start--;
+    window->cnt++;
+    return -1;
+  }
+  return sector;
+}
+
+/* Releases every data sector and extent block of extent based
+   DISK into BATCH. */
+static void
+extent_release(struct inode_disk *disk, struct release_batch *batch)
+{
+  for (uint32_t i = 0; i < disk->extent_cnt; i++)
+    batch_add(batch, disk->extents[i].start, disk->extents[i].length);
+
+  if (disk->extent_index == 0)
+    return;
+
+  struct extent_index *index = malloc(BLOCK_SECTOR_SIZE);
+  struct extent_leaf *leaf = malloc(BLOCK_SECTOR_SIZE);
+  if (index == NULL || leaf == NULL)
+    PANIC(">> malloc failed to allocate 512 bytes");
+
+  cache_read (disk->extent_index, index);
+  for (uint32_t i = 0; i < index->cnt; i++)
+  {
+    cache_read (index->leaves[i].leaf, leaf);
+    for (uint32_t j = 0; j < leaf->cnt; j++)
+      batch_add(batch, leaf->extents[j].start, leaf->extents[j].length);
+    batch_add(batch, index->leaves[i].leaf, 1);
+  }
+  batch_add(batch, disk->extent_index, 1);
+
+  free(index);
+  free(leaf);
+}
+
 /* Returns the block device sector that contains byte offset POS
    within INODE.
    Returns -1 if INODE does not contain data for a byte at offset
-   POS. 
+   POS, which below EOF means POS is in a hole. 
    There is no need to synchronize this since all the indirect 
-   block data associated with a file at any pos <= EOF is static. */
+   block data associated with a file at any pos <= EOF is static. 
+   Index blocks are looked up in INODE's in-memory copies of them. */
 static block_sector_t
-byte_to_sector(const struct inode *inode, off_t pos)
+byte_to_sector(struct inode *inode, off_t pos)
 {
-  /*
-    data_blocks indexes:
-    - 0-9 are direct blocks
-    - 10 is an indirect block
-    - 11 is a double indirect block
-  */
-
   ASSERT(inode != NULL);
   if (pos > inode->data.eof)
   {
@@ -63,12 +607,32 @@ byte_to_sector(const struct inode *inode, off_t pos)
     return -1;
   }
 
-  block_sector_t sector = -1;
-
   /* If the offset position pos is < EOF then we assume the
      sectors are set up and indexed correctly */
+  return index_to_sector(inode, pos / BLOCK_SECTOR_SIZE);
+}
+
+/* Returns the block device sector holding sector FILE_SECTOR_INDEX
+   of INODE's data, regardless of EOF.
+   Returns -1 if that sector has not been allocated. */
+static block_sector_t
+index_to_sector(struct inode *inode, block_sector_t file_sector_index)
+{
+  /*
+    data_blocks indexes:
+    - 0-9 are direct blocks
+    - 10 is an indirect block
+    - 11 is a double indirect block
+  */
+
+  block_sector_t sector = -1;
+
+  /* Inline data has no sectors */
+  if (inode->data.is_inline)
+    return -1;
 
-  block_sector_t file_sector_index = pos / BLOCK_SECTOR_SIZE;
+  if (inode->data.layout == INODE_LAYOUT_EXTENT)
+    return extent_lookup(inode, file_sector_index);
 
   /* Direct block index [0, 9] */
   if (file_sector_index < 10)
@@ -85,7 +649,9 @@ byte_to_sector(const struct inode *inode, off_t pos)
     /* 1 level indirect [10] */
     if (file_sector_index < 128)
     {
-      sector = indirect_sector_lookup(inode->data.data_blocks[10], file_sector_index);
+      sector = indirect_sector_lookup(&inode->indirect_map,
+                                      inode->data.data_blocks[10],
+                                      file_sector_index);
       return sector > 0 ? sector : -1;
     }
 
@@ -97,276 +663,400 @@ byte_to_sector(const struct inode *inode, off_t pos)
 
       /* From the double indirect block, we get the indirect sector index */
       block_sector_t dbl_indirect_index = file_sector_index / 128;
-      block_sector_t indirect_idx = indirect_sector_lookup(inode->data.data_blocks[11], dbl_indirect_index);
+      block_sector_t indirect_idx = indirect_sector_lookup(&inode->dbl_indirect_map,
+                                                           inode->data.data_blocks[11],
+                                                           dbl_indirect_index);
       if (indirect_idx == -1)
       {
         return -1;
       }
 
+      if (inode->dbl_leaf_maps == NULL)
+      {
+        inode->dbl_leaf_maps = calloc(128, sizeof *inode->dbl_leaf_maps);
+        if (inode->dbl_leaf_maps == NULL)
+          return -1;
+      }
+
       /* Using the indirect sector index, we get one of the 128 data blocks */
-      sector = indirect_sector_lookup(indirect_idx, file_sector_index % 128);
+      sector = indirect_sector_lookup(&inode->dbl_leaf_maps[dbl_indirect_index],
+                                      indirect_idx, file_sector_index % 128);
       return sector > 0 ? sector : -1;
     }
   }
 }
 
-/* Returns the number of sectors to allocate for an inode SIZE
-   bytes long. */
-static inline size_t
-bytes_to_sectors(off_t size)
+/* Makes sure *SLOT names an index block, allocating a zeroed one
+   in the block group of sector NEAR if it is 0. Returns true if
+   successful, false if the disk is full. */
+static bool
+index_block_ensure(block_sector_t *slot, block_sector_t near)
 {
-  return DIV_ROUND_UP(size, BLOCK_SECTOR_SIZE);
-}
+  static const uint8_t zero_buffer[BLOCK_SECTOR_SIZE];
 
-/* Finds the index of first occurrance of a zero in buffer.
-   -1 otherwise. */
-block_sector_t 
-find_first_zero(block_sector_t *buffer, unsigned int length)
-{
-  block_sector_t *ptr = buffer;
-  for (int index = 0; index < length; index++, ptr++)
+  if (*slot != 0)
+    return true;
+  if (!free_map_allocate_near(1, near, slot))
   {
-    if (*ptr == 0)
-    {
-      return index;
-    }
+    *slot = 0;
+    return false;
   }
-  return -1;
+  journal_write (*slot, zero_buffer);
+  return true;
 }
 
-/* Allocates a sector in the file system, zeros, and adds it to the
-file's lookup blocks as necessary. Does not move file EOF */
-block_sector_t
-extend_one_sector(struct inode_disk *inode_disk)
+/* Stores VALUE at OFFSET of index block SECTOR, keeping INODE's
+   copies of its index blocks in step. Returns true if successful,
+   false if out of memory. */
+static bool
+index_block_set(struct inode *inode, block_sector_t sector, uint32_t offset,
+                block_sector_t value)
+{
+  block_sector_t *buffer = malloc(BLOCK_SECTOR_SIZE);
+  if (buffer == NULL)
+    return false;
+
+  cache_read (sector, buffer);
+  buffer[offset] = value;
+  journal_write (sector, buffer);
+  index_map_update(inode, sector, buffer);
+  free(buffer);
+  return true;
+}
+
+/* Indexed layout version of allocate_sector_at(). Index blocks on
+   the way to file sector IDX are allocated as needed. */
+static block_sector_t
+index_allocate_at(struct inode_disk *disk, struct inode *inode,
+                  struct prealloc *window, block_sector_t idx, bool zero)
 {
-  ASSERT(inode_disk != NULL);
   /*
     data_blocks indexes:
     - 0-9 are direct blocks
     - 10 is an indirect block
     - 11 is a double indirect block
   */
-  int INDIRECT_INDEX = 10;
-  int DBL_INDIRECT_INDEX = 11;
-  block_sector_t level1_idx = NULL;
-  block_sector_t level2_idx = NULL;
-  block_sector_t sector_number = NULL;
-  
-  uint8_t zero_buffer[BLOCK_SECTOR_SIZE];
-  memset(zero_buffer, 0, BLOCK_SECTOR_SIZE);
-  
-  /* ====== DIRECT BLOCK CHECKING ======= */
+  block_sector_t index_sector;
+  uint32_t offset;
+  block_sector_t sector;
 
-  /* Loop through each direct sector in table */
-  level1_idx = find_first_zero(inode_disk->data_blocks, 10);
-
-  /* Direct sector allocation */
-  if (level1_idx != -1)
+  /* Direct block index [0, 9] */
+  if (idx < 10)
   {
-    if (free_map_allocate(1, &sector_number))
-    {
-      /* Update the lookup table and return the sector index */
-      inode_disk->data_blocks[level1_idx] = sector_number;
-      block_write(fs_device, sector_number, zero_buffer);
-      return sector_number;
-    }
-    else
+    if (!allocate_data_sector(window, zero, &sector))
       return -1;
+    disk->data_blocks[idx] = sector;
+    return sector;
   }
+  idx -= 10;
 
-  /* ====== INDIRECT BLOCK CHECKING ======= */
+  /* 1 level indirect [10] */
+  if (idx < 128)
+  {
+    if (!index_block_ensure(&disk->data_blocks[10], window->home))
+      return -1;
+    index_sector = disk->data_blocks[10];
+    offset = idx;
+  }
 
-  /* Must be either direct or indirect */
+  /* 2 level indirect [11] */
   else
   {
-    /* Special case where indirect block needs to be set up */
-    if (inode_disk->data_blocks[INDIRECT_INDEX] == 0)
+    idx -= 128;
+    if (idx >= 128 * 128)
+      return -1;
+    if (!index_block_ensure(&disk->data_blocks[11], window->home))
+      return -1;
+
+    block_sector_t leaf = 0;
+    cache_read_at (disk->data_blocks[11], &leaf, idx / 128 * sizeof leaf,
+                   sizeof leaf);
+    if (leaf == 0)
     {
-      if (free_map_allocate(1, &sector_number))
+      if (!index_block_ensure(&leaf, window->home))
+        return -1;
+      if (!index_block_set(inode, disk->data_blocks[11], idx / 128, leaf))
       {
-        /* Update the lookup table and return the sector index */
-        inode_disk->data_blocks[INDIRECT_INDEX] = sector_number;
-        block_write(fs_device, sector_number, zero_buffer);
-      }
-      else
+        free_map_release(leaf, 1);
         return -1;
+      }
     }
+    index_sector = leaf;
+    offset = idx % 128;
+  }
 
-    /* Grab the indirect block and check for first zero */
-    block_sector_t *single_indirect_buffer = malloc(128 * sizeof(block_sector_t));
-    if( single_indirect_buffer == NULL)
-      return -1;
-    
-    memset(single_indirect_buffer, 0, BLOCK_SECTOR_SIZE);
-    block_read(fs_device, inode_disk->data_blocks[INDIRECT_INDEX], single_indirect_buffer);
-    level1_idx = find_first_zero(single_indirect_buffer, 128);
+  if (!allocate_data_sector(window, zero, &sector))
+    return -1;
+  if (!index_block_set(inode, index_sector, offset, sector))
+  {
+    /* Hand the sector back to the window it was taken from */
+    window->start--;
+    window->cnt++;
+    return -1;
+  }
+  return sector;
+}
+
+/* Allocates a sector for file sector IDX of INODE_DISK, which must
+lie in a hole, and adds it to the file's lookup blocks as necessary.
+Zeros it if ZERO is true; pass false only if the caller is about to
+overwrite the whole sector anyway. Does not move file EOF. The data
+sector is taken from WINDOW. INODE is the open inode INODE_DISK
+belongs to, if any, so that its in-memory copies of the index
+blocks stay up to date.
+Returns the new sector, or -1 if the disk is full. */
+static block_sector_t
+allocate_sector_at(struct inode_disk *inode_disk, struct inode *inode,
+                   struct prealloc *window, block_sector_t idx, bool zero)
+{
+  ASSERT(inode_disk != NULL);
+
+  if (inode_disk->layout == INODE_LAYOUT_EXTENT)
+    return extent_allocate_at(inode_disk, window, idx, zero);
+  return index_allocate_at(inode_disk, inode, window, idx, zero);
+}
+
+/* Releases every data sector and index block of indexed layout
+   DISK into BATCH. Holes are skipped. The block map is walked
+   once, each index block read a single time. */
+static void
+index_release(struct inode_disk *disk, struct release_batch *batch)
+{
+  block_sector_t *indirect = malloc(BLOCK_SECTOR_SIZE);
+  block_sector_t *leaf = malloc(BLOCK_SECTOR_SIZE);
+  if (indirect == NULL || leaf == NULL)
+    PANIC(">> malloc failed to allocate 512 bytes");
+
+  for (int i = 0; i < 10; i++)
+    if (disk->data_blocks[i] != 0)
+      batch_add(batch, disk->data_blocks[i], 1);
+
+  if (disk->data_blocks[10] != 0)
+  {
+    cache_read (disk->data_blocks[10], indirect);
+    for (int i = 0; i < 128; i++)
+      if (indirect[i] != 0)
+        batch_add(batch, indirect[i], 1);
+    batch_add(batch, disk->data_blocks[10], 1);
+  }
 
-    /* If we found an non allocated direct block, create it */
-    if (level1_idx != -1)
+  if (disk->data_blocks[11] != 0)
+  {
+    cache_read (disk->data_blocks[11], indirect);
+    for (int i = 0; i < 128; i++)
     {
-      if (free_map_allocate(1, &sector_number))
-      {
-        /* Update the lookup table and return the sector index */
-        single_indirect_buffer[level1_idx] = sector_number;
-        block_write(fs_device, sector_number, zero_buffer);
-        block_write(fs_device, inode_disk->data_blocks[INDIRECT_INDEX], single_indirect_buffer);
-        free(single_indirect_buffer);
-        return sector_number;
-      }
-      else
-      {
-        free(single_indirect_buffer);
-        return -1;
-      }
+      if (indirect[i] == 0)
+        continue;
+      cache_read (indirect[i], leaf);
+      for (int j = 0; j < 128; j++)
+        if (leaf[j] != 0)
+          batch_add(batch, leaf[j], 1);
+      batch_add(batch, indirect[i], 1);
     }
+    batch_add(batch, disk->data_blocks[11], 1);
+  }
 
-    /* ====== DOUBLE INDIRECT BLOCK CHECKING ======= */
+  free(indirect);
+  free(leaf);
+}
 
-    /* File size > 69 KB, Must be double indirect then */
-    else {
-      block_sector_t *single_indirect_buffer = malloc(128 * sizeof(block_sector_t));
-      block_sector_t *double_indirect_buffer = malloc(128 * sizeof(block_sector_t));
-      if (single_indirect_buffer == NULL || double_indirect_buffer == NULL)
-        return -1;
+/* Called for every read of SIZE bytes at OFFSET in INODE. If the
+   read continues where the previous one stopped, grows the
+   read-ahead window and asks the cache to prefetch the sectors
+   following the read in the background. Any other access pattern
+   shuts read-ahead off until reads become sequential again. */
+static void
+readahead(struct inode *inode, off_t offset, off_t size)
+{
+  if (offset != inode->ra_next)
+  {
+    inode->ra_window = 0;
+    inode->ra_end = 0;
+  }
+  else if (inode->ra_window == 0)
+    inode->ra_window = READAHEAD_MIN;
+  else if (inode->ra_window < READAHEAD_MAX)
+    inode->ra_window *= 2;
 
-      memset(single_indirect_buffer, 0, BLOCK_SECTOR_SIZE);
-      memset(double_indirect_buffer, 0, BLOCK_SECTOR_SIZE);
+  inode->ra_next = offset + size;
+  if (inode->ra_window == 0)
+    return;
 
-      /* Special case where double indirect block needs to be set up */
-      if (inode_disk->data_blocks[DBL_INDIRECT_INDEX] == 0)
-      {
-        if (free_map_allocate(1, &sector_number))
-        {
-          /* Update the lookup table and return the sector index */
-          inode_disk->data_blocks[DBL_INDIRECT_INDEX] = sector_number;
-          block_write(fs_device, sector_number, zero_buffer);
-        }
-        else
-          return -1;
-      }
+  /* The sector holding the end of this read is fetched by the read
+     itself, start after it and after whatever was already asked. */
+  off_t pos = ROUND_UP(offset + size, BLOCK_SECTOR_SIZE);
+  if (pos < inode->ra_end)
+    pos = inode->ra_end;
 
-      /* Grab the double indirect block and check for first zero */
-      block_read(fs_device, inode_disk->data_blocks[DBL_INDIRECT_INDEX], double_indirect_buffer);
+  off_t limit = ROUND_UP(offset + size, BLOCK_SECTOR_SIZE)
+                + inode->ra_window * BLOCK_SECTOR_SIZE;
+  if (limit > inode->data.eof)
+    limit = inode->data.eof;
 
-      /* Special case where first is zero, then create the indirect block */
-      if (double_indirect_buffer[0] == 0)
-      {
-        if (free_map_allocate(1, &sector_number))
-        {
-          /* Update the lookup table and return the sector index */
-          double_indirect_buffer[0] = sector_number;
-          block_write(fs_device, sector_number, zero_buffer);
-          block_write(fs_device, inode_disk->data_blocks[DBL_INDIRECT_INDEX], double_indirect_buffer);
-        }
-        else
-          return -1;
-      }
+  for (; pos < limit; pos += BLOCK_SECTOR_SIZE)
+  {
+    block_sector_t sector = byte_to_sector(inode, pos);
+    if (sector != -1)
+      cache_readahead(sector);
+  }
 
-      /* Grab the indirect block of the one before the first zero */
-      level1_idx = find_first_zero(double_indirect_buffer, 128);
+  if (pos > inode->ra_end)
+    inode->ra_end = pos;
+}
 
-      /* If it found an empty indirect block */
-      if (level1_idx != -1)
-      {
-        /* We are not just able to grab the next 0 indirect in general since there
-        might be some free sectors in an indirect block that has already been
-        allocated. So we need to check (first_zero - 1) first before trying 
-        to just allocate the next indirect sector and use that. Otherwise we
-        would only ever be using the first direct block of each indirect block. */
-
-        /* level1_idx > 0 since we have already created the 0th indirect block above 
-          if it did not exist */
-        
-        /* Check level1_idx - 1 */
-        block_read(fs_device, double_indirect_buffer[level1_idx - 1], single_indirect_buffer);
-        level2_idx = find_first_zero(single_indirect_buffer, 128);
-        if (level2_idx != -1)
-        {
-          /* Make a direct block */
-          if (free_map_allocate(1, &sector_number))
-          {
-            /* Update the lookup table and return the sector index */
-            single_indirect_buffer[level2_idx] = sector_number;
-            block_write(fs_device, sector_number, zero_buffer);
-            /* Write the updated buffer back to the indirect block */
-            block_write(fs_device, double_indirect_buffer[level1_idx - 1], single_indirect_buffer);
-            free(single_indirect_buffer);
-            free(double_indirect_buffer);
-            return sector_number;
-          }
-          else
-            return -1;
-        }
-        
-        /* If it didn't find one then the previous is full. Make a new indirect block */
-        if (free_map_allocate(1, &sector_number))
-        {
-          /* Update the lookup table and return the sector index */
-          double_indirect_buffer[level1_idx] = sector_number;
-          block_write(fs_device, sector_number, zero_buffer);
-          block_write(fs_device, inode_disk->data_blocks[DBL_INDIRECT_INDEX], double_indirect_buffer);
-        }
-        else
-          return -1;
+/* INLINE DATA AND SECTORS */
 
-        /* We can memset the data buffer instead of reading in the zeros we
-          know to already be in that new block. SPEEEED */
-        memset(single_indirect_buffer, 0, BLOCK_SECTOR_SIZE);
+/* Releases every data sector and index or extent block of DISK. */
+static void
+release_sectors(struct inode_disk *disk)
+{
+  struct release_batch batch;
 
-        /* Make a direct block at the 0th index */
-        if (free_map_allocate(1, &sector_number))
-        {
-          /* Zero the new block */
-          block_write(fs_device, sector_number, zero_buffer);
-          
-          /* Update the indirect block table */
-          (single_indirect_buffer[0]) = sector_number;
-          block_write(fs_device, double_indirect_buffer[level1_idx], single_indirect_buffer);
-
-          free(single_indirect_buffer);
-          free(double_indirect_buffer);
-          return sector_number;
-        }
-        else
-          return -1;
-      }
+  if (disk->is_inline)
+    return;
 
-      /* Otherwise each of the indirect indexes were already filled in so
-        check the last one to make sure the file is indeed full full */
-      else
-      {
-        block_read(fs_device, double_indirect_buffer[127], single_indirect_buffer);
-        level2_idx = find_first_zero(single_indirect_buffer, 128);
-        
-        /* If there is a zero index in the last indirect block */
-        if (level2_idx != -1)
-        {
-          /* Make a direct block */
-          if (free_map_allocate(1, &sector_number))
-          {
-            /* Zero the new block */
-            block_write(fs_device, sector_number, zero_buffer);
-
-            /* Update the indirect block table */
-            single_indirect_buffer[level2_idx] = sector_number;
-            block_write(fs_device, double_indirect_buffer[127], single_indirect_buffer);
-
-            free(single_indirect_buffer);
-            free(double_indirect_buffer);
-            return sector_number;
-          }
-          else
-            return -1;          
-        }
+  batch.cnt = 0;
 
-        /* There is no zero index in the last indirect block. Completely full */
-        else
-        {
-          return -1;
-        }
-      }
+  /* Extents are released a whole run at a time */
+  if (disk->layout == INODE_LAYOUT_EXTENT)
+    extent_release(disk, &batch);
+
+  /* Walk the index blocks, freeing whatever is allocated */
+  else
+    index_release(disk, &batch);
+
+  batch_flush(&batch);
+}
+
+/* Writes SIZE bytes from BUFFER into the sectors of INODE, which
+   must not be inline, starting at OFFSET. Returns the number of
+   bytes actually written. */
+static off_t
+write_sectors(struct inode *inode, const uint8_t *buffer, off_t size,
+              off_t offset)
+{
+  off_t bytes_written = 0;
+
+  /* While there are still bytes left to write */
+  while (size > 0)
+  {
+    /* Calculate where to start, and how many bytes to read in this sector */
+    off_t sector_ofs = offset % BLOCK_SECTOR_SIZE;
+    off_t sector_bytes_to_write = BLOCK_SECTOR_SIZE - sector_ofs;
+
+    if (size < sector_bytes_to_write)
+    {
+      sector_bytes_to_write = size;
+    }
+
+    /* Grab the corresponding sector */
+    bool whole_sector = sector_bytes_to_write == BLOCK_SECTOR_SIZE;
+    block_sector_t file_sector_index = offset / BLOCK_SECTOR_SIZE;
+    block_sector_t sector = index_to_sector(inode, file_sector_index);
+
+    /* Only the sectors written to get allocated, anything skipped
+       over stays a hole. The new sector must read back as zeros
+       where it is not written, unless it is written whole. */
+    if (sector == -1)
+    {
+      sector = allocate_sector_at(&inode->data, inode, &inode->prealloc,
+                                  file_sector_index, !whole_sector);
+      if (sector == -1)
+        return bytes_written;
+      inode->dirty = true;
+    }
+
+    /* Copy straight into the cache. Only a partly written sector
+       has to be read first. */
+    if (inode->journaled)
+      journal_write_at (sector, buffer + bytes_written, sector_ofs,
+                        sector_bytes_to_write);
+    else
+      data_write_at (sector, buffer + bytes_written, sector_ofs,
+                     sector_bytes_to_write);
+
+    /* Advance. */
+    size -= sector_bytes_to_write;
+    offset += sector_bytes_to_write;
+    bytes_written += sector_bytes_to_write;
+    if (offset > inode->data.eof)
+    {
+      /* Extend the EOF to however many bytes we wrote past it */
+      inode->data.eof = offset;
+      inode->dirty = true;
     }
   }
+
+  return bytes_written;
+}
+
+/* Writes SIZE bytes from BUFFER into INODE's inline data, starting
+   at OFFSET, as far as they fit. Returns the number of bytes
+   actually written. */
+static off_t
+inline_write(struct inode *inode, const uint8_t *buffer, off_t size,
+             off_t offset)
+{
+  struct inode_disk *disk = &inode->data;
+
+  if (offset >= INODE_INLINE_SIZE)
+    return 0;
+  if (size > INODE_INLINE_SIZE - offset)
+    size = INODE_INLINE_SIZE - offset;
+
+  memcpy(disk->inline_data + offset, buffer, size);
+  if (offset + size > disk->eof)
+    disk->eof = offset + size;
+  inode->dirty = true;
+  return size;
+}
+
+/* Moves INODE's inline data out into sectors of their own, in the
+   layout recorded in the inode, so the file can grow past
+   INODE_INLINE_SIZE. Leaves INODE as it was if that fails. */
+static void
+inline_migrate(struct inode *inode)
+{
+  struct inode_disk *disk = &inode->data;
+  off_t length = disk->eof;
+
+  uint8_t *saved = malloc(INODE_INLINE_SIZE);
+  if (saved == NULL)
+    return;
+  memcpy(saved, disk->inline_data, INODE_INLINE_SIZE);
+
+  /* An empty block map or extent list is all zeros */
+  memset(disk->inline_data, 0, INODE_INLINE_SIZE);
+  disk->is_inline = 0;
+  if (write_sectors(inode, saved, length, 0) == length)
+    inode->dirty = true;
+  else
+  {
+    release_sectors(disk);
+    index_map_free(inode);
+    inode->extent_hint.length = 0;
+    memcpy(disk->inline_data, saved, INODE_INLINE_SIZE);
+    disk->is_inline = 1;
+  }
+  free(saved);
+}
+
+/* Returns a hash value for the inode containing E. */
+static unsigned
+inode_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  const struct inode *inode = hash_entry (e, struct inode, elem);
+  return hash_int (inode->sector);
+}
+
+/* Returns true if the inode containing A comes before the one
+   containing B. */
+static bool
+inode_less (const struct hash_elem *a, const struct hash_elem *b,
+            void *aux UNUSED)
+{
+  return hash_entry (a, struct inode, elem)->sector
+         < hash_entry (b, struct inode, elem)->sector;
 }
 
 /* INODE FUNCTIONS */
@@ -375,17 +1065,36 @@ extend_one_sector(struct inode_disk *inode_disk)
 void
 inode_init (void) 
 {
-  list_init (&open_inodes);
+  hash_init (&open_inodes, inode_hash, inode_less, NULL);
+  lock_init (&open_inodes_lock);
   list_init (&sectors_in_use);
+
+  list_init (&reclaim_list);
+  lock_init (&reclaim_lock);
+  cond_init (&reclaim_ready);
+  cond_init (&reclaim_idle);
+  reclaim_busy = false;
+  thread_create ("reclaim", PRI_DEFAULT, reclaim_worker, NULL);
+
+  ASSERT (sizeof (struct extent_leaf) == BLOCK_SECTOR_SIZE);
+  ASSERT (sizeof (struct extent_index) == BLOCK_SECTOR_SIZE);
+}
+
+/* Sets the layout used by inodes created from now on. */
+void
+inode_set_default_layout (enum inode_layout layout)
+{
+  default_layout = layout;
 }
 
 /* Initializes an inode with LENGTH bytes of data and
    writes the new inode to sector SECTOR on the file system
-   device.
+   device. The data starts out as one big hole, which reads back
+   as zeros and gets sectors as it is written.
    Returns true if successful.
    Returns false if memory or disk allocation fails. */
 bool
-inode_create (block_sector_t sector, off_t length, bool isDir, block_sector_t parent_sector)
+inode_create (block_sector_t sector, off_t length, enum inode_type type, block_sector_t parent_sector)
 {
   struct inode_disk *disk_inode = NULL;
   bool success = false;
@@ -396,33 +1105,18 @@ inode_create (block_sector_t sector, off_t length, bool isDir, block_sector_t pa
      one sector in size, and you should fix that. */
   ASSERT (sizeof *disk_inode == BLOCK_SECTOR_SIZE);
 
-  disk_inode = malloc(sizeof *disk_inode);
+  disk_inode = calloc(1, sizeof *disk_inode);
   if (disk_inode != NULL)
   {
-    size_t sectors = bytes_to_sectors (length) + 1;
     disk_inode->magic = INODE_MAGIC;
-    disk_inode->type = isDir ? INODE_TYPE_DIR : INODE_TYPE_FILE;
+    disk_inode->layout = default_layout;
+    disk_inode->type = type;
     disk_inode->parent = parent_sector;
     disk_inode->eof = length;
-    memset(disk_inode->data_blocks, 0, 12 * sizeof(block_sector_t));
-
-    /* For each sector we need to write to, free_map_allocate it
-    then mark is as being written to in the sectors_in_use list.
-    After done writing, remove it from the in use list. */
-    for (size_t sectors_left_to_write = sectors; sectors_left_to_write > 0; sectors_left_to_write--)
-    {
-      /* Synchronization here? */
-      block_sector_t new_sec = extend_one_sector(disk_inode);
-      if (new_sec == -1)
-      {
-        printf(">> Could not increase file size\n");
-        return false;
-      }
-      // printf(">> Extended a file by adding sector %d\n", new_sec);
-    }
+    disk_inode->is_inline = length <= INODE_INLINE_SIZE;
 
     /* Write the new disk inode to it's sector */
-    block_write(fs_device, sector, disk_inode);
+    journal_write (sector, disk_inode);
     success = true;
     // printf(">> Created Inode at sector: %d\n", sector);
 
@@ -438,33 +1132,54 @@ inode_create (block_sector_t sector, off_t length, bool isDir, block_sector_t pa
 struct inode *
 inode_open (block_sector_t sector)
 {
-  struct list_elem *e;
+  struct inode key;
+  struct hash_elem *e;
   struct inode *inode;
 
   /* Check whether this inode is already open. */
-  for (e = list_begin (&open_inodes); e != list_end (&open_inodes);
-       e = list_next (e)) 
+  lock_acquire (&open_inodes_lock);
+  key.sector = sector;
+  e = hash_find (&open_inodes, &key.elem);
+  if (e != NULL)
     {
-      inode = list_entry (e, struct inode, elem);
-      if (inode->sector == sector) 
-        {
-          inode_reopen (inode);
-          return inode; 
-        }
+      inode = hash_entry (e, struct inode, elem);
+      inode->open_cnt++;
+      lock_release (&open_inodes_lock);
+      return inode;
     }
 
   /* Allocate memory. */
   inode = malloc (sizeof *inode);
   if (inode == NULL)
-    return NULL;
+    {
+      lock_release (&open_inodes_lock);
+      return NULL;
+    }
 
-  /* Initialize. */
-  list_push_front (&open_inodes, &inode->elem);
+  /* Initialize. The lock is held until the inode is read in so
+     nobody else finds it half done. */
   inode->sector = sector;
+  hash_insert (&open_inodes, &inode->elem);
   inode->open_cnt = 1;
   inode->deny_write_cnt = 0;
   inode->removed = false;
-  block_read (fs_device, inode->sector, &inode->data);
+  inode->ra_next = 0;
+  inode->ra_end = 0;
+  inode->ra_window = 0;
+  inode->indirect_map = NULL;
+  inode->dbl_indirect_map = NULL;
+  inode->dbl_leaf_maps = NULL;
+  inode->extent_hint.length = 0;
+  inode->prealloc.cnt = 0;
+  inode->prealloc.home = sector;
+  inode->dirty = false;
+  rw_init (&inode->rw);
+  lock_init (&inode->map_lock);
+  lock_init (&inode->dir_lock);
+  cache_read (inode->sector, &inode->data);
+  inode->journaled = inode->data.type != INODE_TYPE_FILE
+                     || sector == FREE_MAP_SECTOR;
+  lock_release (&open_inodes_lock);
   return inode;
 }
 
@@ -473,7 +1188,11 @@ struct inode *
 inode_reopen (struct inode *inode)
 {
   if (inode != NULL)
+  {
+    lock_acquire (&open_inodes_lock);
     inode->open_cnt++;
+    lock_release (&open_inodes_lock);
+  }
   return inode;
 }
 
@@ -494,29 +1213,180 @@ inode_close (struct inode *inode)
   if (inode == NULL)
     return;
 
-  /* Release resources if this was the last opener. */
-  if (--inode->open_cnt == 0)
+  lock_acquire (&open_inodes_lock);
+  if (inode->open_cnt > 1)
+  {
+    inode->open_cnt--;
+    lock_release (&open_inodes_lock);
+    return;
+  }
+  lock_release (&open_inodes_lock);
+
+  /* Metadata changes made while open go to disk once, now. The
+     inode stays in open_inodes meanwhile, so a concurrent
+     inode_open() shares it instead of reading the stale copy on
+     disk. */
+  if (!inode->removed)
+    inode_flush (inode);
+
+  /* Release resources if this is still the last opener. */
+  lock_acquire (&open_inodes_lock);
+  bool last = --inode->open_cnt == 0;
+  if (last)
+    hash_delete (&open_inodes, &inode->elem);
+  lock_release (&open_inodes_lock);
+
+  if (last)
   {
-    /* Remove from inode list and release lock. */
-    list_remove (&inode->elem);
+    /* Give back the sectors reserved for growth but never used */
+    prealloc_release (&inode->prealloc);
 
     /* Deallocate blocks if removed. */
     if (inode->removed) 
     {
-      unsigned int sectors_to_release = bytes_to_sectors(inode->data.eof);
-      free_map_release(inode->sector, 1);
+      journal_begin ();
+
+      /* A directory's name index goes with it */
+      if (inode->data.type == INODE_TYPE_DIR && inode->data.dir_index != 0)
+      {
+        struct inode *index = inode_open(inode->data.dir_index);
+        if (index != NULL)
+        {
+          inode_remove(index);
+          inode_close(index);
+        }
+      }
       
-      /* In 512 byte offset increments, find the corresponding sector, and free it */
-      for (int sec = 0; sec < sectors_to_release; sec++)
+      /* A large file is left to the reclaim thread */
+      if (!reclaim_later (inode))
       {
-        free_map_release (byte_to_sector(inode, sec * BLOCK_SECTOR_SIZE), 1); 
+        free_map_release(inode->sector, 1);
+        release_sectors(&inode->data);
       }
+      journal_end ();
     }
 
+    index_map_free (inode);
     free (inode); 
   }
 }
 
+/* Writes INODE's on-disk inode through the journal if it
+   changed since it was last written.
+   Caller must hold INODE's rw lock for writing. */
+static void
+inode_write_disk (struct inode *inode)
+{
+  if (inode->dirty)
+  {
+    journal_write (inode->sector, &inode->data);
+    inode->dirty = false;
+  }
+}
+
+/* Hands removed INODE, last closed, to the reclaim thread if it
+   has enough data to make releasing it slow. Returns true if it
+   did, false if the caller should release it now. */
+static bool
+reclaim_later (struct inode *inode)
+{
+  if (inode->data.is_inline || inode->data.eof <= RECLAIM_MIN_SIZE)
+    return false;
+
+  struct reclaim *r = malloc (sizeof *r);
+  if (r == NULL)
+    return false;
+  r->sector = inode->sector;
+  r->data = inode->data;
+
+  lock_acquire (&reclaim_lock);
+  list_push_back (&reclaim_list, &r->elem);
+  cond_signal (&reclaim_ready, &reclaim_lock);
+  lock_release (&reclaim_lock);
+  return true;
+}
+
+/* Kernel thread that releases the sectors of the removed inodes
+   queued by reclaim_later(), one inode at a time. */
+static void
+reclaim_worker (void *aux UNUSED)
+{
+  for (;;)
+  {
+    lock_acquire (&reclaim_lock);
+    while (list_empty (&reclaim_list))
+    {
+      reclaim_busy = false;
+      cond_broadcast (&reclaim_idle, &reclaim_lock);
+      cond_wait (&reclaim_ready, &reclaim_lock);
+    }
+    struct reclaim *r = list_entry (list_pop_front (&reclaim_list),
+                                    struct reclaim, elem);
+    reclaim_busy = true;
+    lock_release (&reclaim_lock);
+
+    journal_begin ();
+    free_map_release (r->sector, 1);
+    release_sectors (&r->data);
+    journal_end ();
+    free (r);
+  }
+}
+
+/* Waits until the reclaim thread has released every removed inode
+   queued so far. Returns true if there were any. */
+bool
+inode_reclaim_wait (void)
+{
+  lock_acquire (&reclaim_lock);
+  bool pending = reclaim_busy || !list_empty (&reclaim_list);
+  while (reclaim_busy || !list_empty (&reclaim_list))
+    cond_wait (&reclaim_idle, &reclaim_lock);
+  lock_release (&reclaim_lock);
+  return pending;
+}
+
+/* Records that INODE's on-disk inode no longer matches its
+   in-memory copy. Once the journal is running the change is
+   logged right away, in the caller's transaction. */
+void
+inode_mark_dirty (struct inode *inode)
+{
+  rw_write_acquire (&inode->rw);
+  inode->dirty = true;
+  if (journal_active ())
+    inode_write_disk (inode);
+  rw_write_release (&inode->rw);
+}
+
+/* Writes INODE's on-disk inode back to the buffer cache if it
+   changed since it was last written. Before the journal is
+   running, metadata changes are only kept in memory until this
+   is called or INODE is last closed. */
+void
+inode_flush (struct inode *inode)
+{
+  rw_write_acquire (&inode->rw);
+  inode_write_disk (inode);
+  rw_write_release (&inode->rw);
+}
+
+/* hash_apply() action that flushes the inode containing E. */
+static void
+inode_flush_action (struct hash_elem *e, void *aux UNUSED)
+{
+  inode_flush (hash_entry (e, struct inode, elem));
+}
+
+/* Writes back every open inode that changed. */
+void
+inode_flush_all (void)
+{
+  lock_acquire (&open_inodes_lock);
+  hash_apply (&open_inodes, inode_flush_action);
+  lock_release (&open_inodes_lock);
+}
+
 /* Marks INODE to be deleted when it is closed by the last caller who
    has it open. */
 void
@@ -534,6 +1404,27 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
 {
   uint8_t *buffer = buffer_;
   off_t bytes_read = 0;
+
+  rw_read_acquire (&inode->rw);
+
+  /* Small files are read straight out of the inode */
+  if (inode->data.is_inline)
+  {
+    if (offset < inode->data.eof)
+    {
+      bytes_read = inode->data.eof - offset;
+      if (size < bytes_read)
+        bytes_read = size;
+      memcpy(buffer, inode->data.inline_data + offset, bytes_read);
+    }
+    rw_read_release (&inode->rw);
+    return bytes_read;
+  }
+
+  /* Get the sectors after this read coming while we copy */
+  lock_acquire (&inode->map_lock);
+  readahead(inode, offset, size);
+  lock_release (&inode->map_lock);
   
   /* While there are still bytes left to read */
   while (size > 0)
@@ -546,24 +1437,46 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
 
     /* Calculate where to start, and how many bytes to read in this sector */
     off_t sector_ofs = offset % BLOCK_SECTOR_SIZE;
+    off_t inode_left = inode->data.eof - offset;
     off_t sector_bytes_to_read = BLOCK_SECTOR_SIZE - sector_ofs;
 
+    if (inode_left < sector_bytes_to_read)
+    {
+      sector_bytes_to_read = inode_left;
+    }
     if (size < sector_bytes_to_read)
     {
       sector_bytes_to_read = size;
     }
 
-    /* Grab the corresponding sector (TODO: Check cache) */
-    uint8_t data[BLOCK_SECTOR_SIZE];
+    /* Grab the corresponding sector, and if it is read whole, the
+       whole sectors after it that also follow it on disk */
+    size_t sector_cnt = 0;
+    lock_acquire (&inode->map_lock);
     block_sector_t sector = byte_to_sector(inode, offset);
-    if (sector == -1)
+    if (sector != -1 && sector_bytes_to_read == BLOCK_SECTOR_SIZE)
     {
-      break;
+      sector_cnt = 1;
+      while ((off_t) (sector_cnt + 1) * BLOCK_SECTOR_SIZE <= size
+             && (off_t) (sector_cnt + 1) * BLOCK_SECTOR_SIZE <= inode_left
+             && byte_to_sector(inode, offset + sector_cnt * BLOCK_SECTOR_SIZE)
+                == sector + sector_cnt)
+        sector_cnt++;
     }
+    lock_release (&inode->map_lock);
 
-    /* Read the sector data in local variable */
-    block_read(fs_device, sector, data);
-    memcpy(buffer + bytes_read, data + sector_ofs, sector_bytes_to_read);
+    /* Copy straight into the caller's buffer, from the cache if
+       possible. A run of whole sectors goes to the disk as one
+       request. A hole reads back as zeros. */
+    if (sector == -1)
+      memset(buffer + bytes_read, 0, sector_bytes_to_read);
+    else if (sector_cnt > 0)
+    {
+      cache_read_multiple (sector, sector_cnt, buffer + bytes_read);
+      sector_bytes_to_read = sector_cnt * BLOCK_SECTOR_SIZE;
+    }
+    else
+      cache_read_at (sector, buffer + bytes_read, sector_ofs, sector_bytes_to_read);
 
     /* Advance. */
     size -= sector_bytes_to_read;
@@ -571,6 +1484,7 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
     bytes_read += sector_bytes_to_read;
   }
 
+  rw_read_release (&inode->rw);
   return bytes_read;
 }
 
@@ -579,96 +1493,80 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
    less than SIZE if file can not be extended further or an 
    error occurs. 
    
-   Writing beyond EOF will cause the file to try to fill in the
-   missing gap with 0 bytes, then continue writing and file 
-   extension as normal. */
+   Writing beyond EOF leaves the gap as a hole that reads back
+   as 0 bytes, then continues writing and file extension as
+   normal. */
 off_t
 inode_write_at (struct inode *inode, const void *buffer_, off_t size,
                 off_t offset) 
 {
   const uint8_t *buffer = buffer_;
   off_t bytes_written = 0;
-  uint8_t *bounce = NULL;
 
+  /* Writers have the inode, its index copies included, to
+     themselves for the whole write, so readers never see part of
+     it. The journal handles below are opened with the lock held.
+     Directories, name indexes and the free map are only written
+     inside a handle already, so theirs are nested and never wait,
+     and nobody waits for any other file's rw lock with a handle
+     open. */
+  rw_write_acquire (&inode->rw);
   if (inode->deny_write_cnt)
-    return 0;
-
-  /* If the write offset is beyond the EOF, allocate missing sectors 
-     in between and fill in with 0 bytes */
-  //printf(">> Offset: %d, EOF: %d\n", offset, inode->data.eof);
-  if (offset > inode->data.eof)
   {
-    off_t byte_difference = offset - inode->data.eof;
-    size_t sectors_to_create = bytes_to_sectors(byte_difference);
-    //printf(">> Trying to make %d new sectors to fill in space \n", sectors_to_create);
-    while (sectors_to_create > 0)
-    {
-      if (extend_one_sector(&inode->data) == -1)
-      {
-        printf(">> Could not allocate enough space to grow file to write at byte %d\n", offset);
-        return bytes_written;
-      }
-      sectors_to_create--;
-    }
-
-    inode->data.eof = offset;
+    rw_write_release (&inode->rw);
+    return 0;
   }
 
-  /* Now offset <= EOF */
-  /* While there are still bytes left to write */
+  /* A long write is logged a few sectors at a time, so that no
+     handle outgrows its share of the transaction */
   while (size > 0)
   {
-    /* Calculate where to start, and how many bytes to read in this sector */
-    off_t sector_ofs = offset % BLOCK_SECTOR_SIZE;
-    off_t sector_bytes_to_write = BLOCK_SECTOR_SIZE - sector_ofs;
-
-    if (size < sector_bytes_to_write)
-    {
-      sector_bytes_to_write = size;
-    }
+    off_t chunk = WRITE_CHUNK_SECTORS * BLOCK_SECTOR_SIZE
+                  - offset % BLOCK_SECTOR_SIZE;
+    if (chunk > size)
+      chunk = size;
+
+    off_t written = write_chunk (inode, buffer + bytes_written, chunk, offset);
+    size -= written;
+    offset += written;
+    bytes_written += written;
+    if (written < chunk)
+      break;
+  }
 
-    /* Grab the corresponding sector (TODO: Check cache) */
-    uint8_t *data = malloc(BLOCK_SECTOR_SIZE);
-    if (!data)
-      return bytes_written;
+  rw_write_release (&inode->rw);
+  return bytes_written; 
+}
 
-    block_sector_t sector = byte_to_sector(inode, offset);
+/* Writes SIZE bytes from BUFFER into INODE, starting at OFFSET,
+   for inode_write_at(). SIZE spans no more than
+   WRITE_CHUNK_SECTORS sectors. Returns the number of bytes
+   actually written.
+   Caller must hold INODE's rw lock for writing. */
+static off_t
+write_chunk (struct inode *inode, const uint8_t *buffer, off_t size,
+             off_t offset)
+{
+  off_t bytes_written;
 
-    if(sector == -1)
-      sector = extend_one_sector (&inode->data);
+  /* Sectors allocated for the write, the blocks pointing to them
+     and the inode itself are logged as one transaction */
+  journal_begin ();
 
-    /* Read the sector data in local variable */
-    block_read(fs_device, sector, data);
+  /* Small files are kept in the inode until they outgrow it */
+  if (inode->data.is_inline && offset + size > INODE_INLINE_SIZE)
+    inline_migrate(inode);
 
-    /* TODO: Write to cache */
-    memcpy(data + sector_ofs, buffer + bytes_written, sector_bytes_to_write);
-    block_write(fs_device, sector, data);
+  if (inode->data.is_inline)
+    bytes_written = inline_write(inode, buffer, size, offset);
+  else
+    bytes_written = write_sectors(inode, buffer, size, offset);
 
-    /* Advance. */
-    size -= sector_bytes_to_write;
-    offset += sector_bytes_to_write;
-    bytes_written += sector_bytes_to_write;
-    if (offset > inode->data.eof)
-    {
-      /* Extend the EOF to however many bytes we wrote past it */
-      inode->data.eof = offset;
-    }
+  if (journal_active ())
+    inode_write_disk (inode);
 
-    /* We will need more space for the next write */
-    if (inode->data.eof == offset && byte_to_sector(inode, offset) == -1)
-    {
-      sector = extend_one_sector(&inode->data);
-      if (sector == -1)
-      {
-        /* Space could not be allocated to extend */
-        free(data);
-        return bytes_written;
-      }
-    }
-    free(data);
-  }
-  
-  return bytes_written; 
+  journal_end ();
+  return bytes_written;
 }
 
 /* Disables writes to INODE.
@@ -676,8 +1574,10 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
 void
 inode_deny_write (struct inode *inode) 
 {
+  rw_write_acquire (&inode->rw);
   inode->deny_write_cnt++;
   ASSERT (inode->deny_write_cnt <= inode->open_cnt);
+  rw_write_release (&inode->rw);
 }
 
 /* Re-enables writes to INODE.
@@ -686,9 +1586,11 @@ inode_deny_write (struct inode *inode)
 void
 inode_allow_write (struct inode *inode) 
 {
+  rw_write_acquire (&inode->rw);
   ASSERT (inode->deny_write_cnt > 0);
   ASSERT (inode->deny_write_cnt <= inode->open_cnt);
   inode->deny_write_cnt--;
+  rw_write_release (&inode->rw);
 }
 
 /* Returns the length, in bytes, of INODE's data. */
@@ -2,9 +2,11 @@
 #define FILESYS_INODE_H
 
 #include <stdbool.h>
+#include <hash.h>
 #include <list.h>
 #include "filesys/off_t.h"
 #include "devices/block.h"
+#include "threads/synch.h"
 #include <list.h>
 
 struct bitmap;
@@ -24,42 +26,121 @@ struct sector_lock
 enum inode_type {
   INODE_TYPE_FILE,
   INODE_TYPE_DIR,
+  INODE_TYPE_INDEX,             /* A directory's name index. */
 };
 
+/* How an inode maps file offsets to sectors. Chosen for the whole
+   file system when it is formatted. */
+enum inode_layout {
+  INODE_LAYOUT_INDEXED,         /* Direct, indirect and double indirect blocks. */
+  INODE_LAYOUT_EXTENT,          /* Runs of contiguous sectors. */
+};
+
+/* A run of LENGTH contiguous sectors starting at sector START,
+   holding sectors LOGICAL through LOGICAL + LENGTH - 1 of a file. */
+struct extent
+{
+    uint32_t logical;               /* First file sector in the run. */
+    block_sector_t start;           /* First disk sector in the run. */
+    uint32_t length;                /* Number of sectors in the run. */
+};
+
+/* Number of extents stored in the inode itself. The rest spill
+   into extent blocks. */
+#define INODE_EXTENT_CNT 24
+
+/* Bytes of data a file or directory can keep in its inode sector
+   before it needs sectors of its own. */
+#define INODE_INLINE_SIZE 464
+
 /* On-disk inode.
    Must be exactly BLOCK_SECTOR_SIZE bytes long. */
 struct inode_disk
 {
-    /* The inode stored on disk is now sector indexes to
-      a direct or indirect data block */
-    block_sector_t data_blocks[12]; /*  */
     unsigned magic;                 /* Magic number. */
     off_t eof;                      /* Byte where the EOF is located. Filesize in bytes */
     block_sector_t parent;          /* Sector number of parent, if type == INODE_TYPE_DIR, NULL otherwise. */
     enum inode_type type;           /* The type of inode */
-    uint32_t unused[112];           /* Not used. */
+    enum inode_layout layout;       /* How data sectors are found once not inline. */
+    uint32_t is_inline;             /* Nonzero while the data is in INLINE_DATA. */
 
-    /* 4*12 + 4*1 + 4*1 + 4*1 + 4*1 + 4*112 = 512 */
+    /* Used by INODE_TYPE_DIR */
+    block_sector_t dir_index;       /* Inode of the name index, 0 if none. */
+    uint32_t dir_index_slots;       /* Slots in the index, a power of 2. */
+    uint32_t dir_index_used;        /* Index slots not empty, deleted ones included. */
+    uint32_t dir_index_built;       /* Entries before this one are in the index. */
+    uint32_t dir_entry_cnt;         /* Entries in use. */
+    uint32_t dir_free_hint;         /* No free entry comes before this one. */
+
+    /* Where the data is. Only one member is in use at a time. */
+    union
+    {
+      /* The inode stored on disk is now sector indexes to
+        a direct or indirect data block */
+      block_sector_t data_blocks[12]; /* Used by INODE_LAYOUT_INDEXED. */
+
+      /* Used by INODE_LAYOUT_EXTENT */
+      struct
+      {
+        uint32_t extent_cnt;        /* Extents in use in EXTENTS. */
+        block_sector_t extent_index; /* Extent index block, 0 if none. */
+        struct extent extents[INODE_EXTENT_CNT]; /* First extents. */
+      };
+
+      uint8_t inline_data[INODE_INLINE_SIZE]; /* Used while IS_INLINE. */
+    };
+
+    /* 4*6 + 4*6 + 464 = 512 */
+};
+
+/* Free sectors reserved ahead of time for a growing file, so that
+   it grows into contiguous sectors. Sectors are still assigned
+   when the write that needs them happens, not deferred until the
+   data is written back: the buffer cache is keyed by device
+   sector, so cached data must already have one. */
+struct prealloc
+{
+  block_sector_t start;               /* Next reserved sector. */
+  size_t cnt;                         /* Number of reserved sectors left. */
+  block_sector_t home;                /* Reserve in this sector's block group. */
 };
 
 /* In-memory inode. */
 struct inode 
 {
-  struct list_elem elem;              /* Element in inode list. */
+  struct hash_elem elem;              /* Element in open_inodes. */
   block_sector_t sector;              /* Sector number of disk location. */
   int open_cnt;                       /* Number of openers. */
   bool removed;                       /* True if deleted, false otherwise. */
   int deny_write_cnt;                 /* 0: writes ok, >0: deny writes. */
+  bool dirty;                         /* True if DATA changed since last written. */
+  bool journaled;                     /* True if the data is metadata, written through the journal. */
+  off_t ra_next;                      /* Offset a sequential reader would read next. */
+  off_t ra_end;                       /* Read-ahead was requested up to here. */
+  size_t ra_window;                   /* Sectors to read ahead, 0 if not sequential. */
+  block_sector_t *indirect_map;       /* Copy of the indirect block, NULL until used. */
+  block_sector_t *dbl_indirect_map;   /* Copy of the double indirect block, NULL until used. */
+  block_sector_t **dbl_leaf_maps;     /* Copies of the double indirect's children, NULL until used. */
+  struct extent extent_hint;          /* Extent of the last lookup, length 0 if none. */
+  struct prealloc prealloc;           /* Sectors reserved for the file to grow into. */
+  struct rwlock rw;                   /* Held to read or write the data. */
+  struct lock map_lock;               /* Guards the read-ahead state and index copies among readers. */
+  struct lock dir_lock;               /* Held while a directory's entries change. */
   struct inode_disk data;             /* Inode content. */
 };
 
 void inode_init (void);
-bool inode_create (block_sector_t, off_t, bool, block_sector_t);
+void inode_set_default_layout (enum inode_layout);
+bool inode_create (block_sector_t, off_t, enum inode_type, block_sector_t);
 struct inode *inode_open (block_sector_t);
 struct inode *inode_reopen (struct inode *);
 block_sector_t inode_get_inumber (const struct inode *);
 void inode_close (struct inode *);
 void inode_remove (struct inode *);
+void inode_mark_dirty (struct inode *);
+void inode_flush (struct inode *);
+void inode_flush_all (void);
+bool inode_reclaim_wait (void);
 off_t inode_read_at (struct inode *, void *, off_t size, off_t offset);
 off_t inode_write_at (struct inode *, const void *, off_t size, off_t offset);
 void inode_deny_write (struct inode *);
@@ -0,0 +1,449 @@
+#include "filesys/journal.h"
+#include <bitmap.h>
+#include <debug.h>
+#include <string.h>
+#include "filesys/filesys.h"
+#include "filesys/free-map.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+
+/* Identify the journal's blocks. */
+#define HEADER_MAGIC 0x4a484452         /* Journal header. */
+#define DESC_MAGIC 0x4a444553           /* Transaction descriptor. */
+#define COMMIT_MAGIC 0x4a434d54         /* Transaction commit block. */
+
+/* Sector numbers that fit in a descriptor block. */
+#define DESC_CNT 125
+
+/* Most sectors one transaction holds: the room its handles
+   reserve, and the spare room for those that outgrow it. */
+#define TRANS_CAP (JOURNAL_TRANS_MAX + JOURNAL_SPARE)
+
+/* Journal header, kept in JOURNAL_SECTOR.
+   Must be exactly BLOCK_SECTOR_SIZE bytes long. */
+struct journal_header
+{
+  unsigned magic;                   /* HEADER_MAGIC. */
+  block_sector_t start;             /* First sector of the log region. */
+  uint32_t size;                    /* Sectors in the log region. */
+  uint32_t seq;                     /* Transaction at the start of the log. */
+  uint8_t unused[496];
+};
+
+/* First block of a transaction in the log. It is followed by the
+   new contents of each sector it names, in order, then by a
+   commit block. */
+struct journal_desc
+{
+  unsigned magic;                   /* DESC_MAGIC. */
+  uint32_t seq;                     /* Transaction sequence number. */
+  uint32_t cnt;                     /* Sectors logged. */
+  block_sector_t sectors[DESC_CNT]; /* Where the logged sectors belong. */
+};
+
+/* Last block of a transaction in the log. A transaction without
+   one never committed and is ignored. */
+struct journal_commit_block
+{
+  unsigned magic;                   /* COMMIT_MAGIC. */
+  uint32_t seq;                     /* Same as in the descriptor. */
+  uint8_t unused[504];
+};
+
+/* True once the log has been replayed and changes are logged.
+   Until then journal_write_at() writes straight to the cache. */
+static bool active;
+
+static struct journal_header header;  /* Copy of the on-disk header. */
+static uint32_t head;                 /* Next free sector in the log. */
+static uint32_t seq;                  /* Running transaction's number. */
+
+/* Sectors logged by the running transaction. */
+static block_sector_t trans[TRANS_CAP];
+static size_t trans_cnt;
+
+/* Number of open outermost handles. A transaction only commits
+   while no handle is open, so it never holds half an operation. */
+static int handle_cnt;
+
+/* Sectors the open handles may still add to the running
+   transaction. Together with TRANS_CNT, never more than
+   JOURNAL_TRANS_MAX unless a handle has outgrown its share. */
+static size_t reserved;
+
+/* Set when someone waits for the running transaction to commit. */
+static bool commit_wanted;
+
+/* Sectors with an image in the log since it was last reset. Data
+   written to one of them is logged too, or replaying an older
+   image would overwrite it. */
+static struct bitmap *in_log;
+
+/* A transaction's descriptor followed by the images it logs, laid
+   out as in the log so that they move with one multi-sector
+   transfer. Used during a commit, and by replay() and
+   journal_create() before any commit can happen. */
+static struct
+  {
+    struct journal_desc desc;
+    uint8_t images[TRANS_CAP][BLOCK_SECTOR_SIZE];
+  } staged;
+
+/* Sectors in STAGED. */
+#define STAGED_CNT (sizeof staged / BLOCK_SECTOR_SIZE)
+
+/* Protects everything above. Also held across a commit, which
+   waits only on the buffer cache and the disk. */
+static struct lock journal_lock;
+
+/* Signaled when a transaction commits. */
+static struct condition journal_committed;
+
+static void replay (void);
+static void commit (void);
+static void checkpoint (void);
+static void reset_log (uint32_t);
+static bool trans_add (block_sector_t);
+
+/* Initializes the journal module. */
+void
+journal_init (void)
+{
+  lock_init (&journal_lock);
+  cond_init (&journal_committed);
+  in_log = bitmap_create (block_size (fs_device));
+  if (in_log == NULL)
+    PANIC ("bitmap creation failed--file system device is too large");
+  active = false;
+}
+
+/* Allocates the log region of a new file system and writes the
+   journal header. */
+void
+journal_create (void)
+{
+  block_sector_t start;
+
+  if (!free_map_allocate (JOURNAL_SIZE, &start))
+    PANIC ("journal creation failed");
+
+  /* Whatever an earlier file system left in the region must not
+     pass for a transaction. */
+  memset (&staged, 0, sizeof staged);
+  for (size_t i = 0; i < JOURNAL_SIZE; i += STAGED_CNT)
+    {
+      size_t cnt = JOURNAL_SIZE - i < STAGED_CNT ? JOURNAL_SIZE - i : STAGED_CNT;
+      block_write_multiple (fs_device, start + i, cnt, &staged);
+    }
+
+  memset (&header, 0, sizeof header);
+  header.magic = HEADER_MAGIC;
+  header.start = start;
+  header.size = JOURNAL_SIZE;
+  header.seq = 1;
+  block_write (fs_device, JOURNAL_SECTOR, &header);
+}
+
+/* Reads the journal header, replays every committed transaction
+   in the log and starts logging changes. */
+void
+journal_open (void)
+{
+  ASSERT (sizeof (struct journal_header) == BLOCK_SECTOR_SIZE);
+  ASSERT (sizeof (struct journal_desc) == BLOCK_SECTOR_SIZE);
+  ASSERT (sizeof (struct journal_commit_block) == BLOCK_SECTOR_SIZE);
+  ASSERT (TRANS_CAP <= DESC_CNT);
+  ASSERT (sizeof staged == (TRANS_CAP + 1) * BLOCK_SECTOR_SIZE);
+
+  block_read (fs_device, JOURNAL_SECTOR, &header);
+  if (header.magic != HEADER_MAGIC)
+    PANIC ("file system has no journal, it needs formatting");
+
+  replay ();
+  trans_cnt = 0;
+  handle_cnt = 0;
+  reserved = 0;
+  commit_wanted = false;
+  active = true;
+}
+
+/* Commits the running transaction and writes everything back, so
+   the log is empty the next time the file system is opened. */
+void
+journal_close (void)
+{
+  if (!active)
+    return;
+
+  lock_acquire (&journal_lock);
+  ASSERT (handle_cnt == 0);
+  commit ();
+  checkpoint ();
+  lock_release (&journal_lock);
+}
+
+/* Returns true if changes are being logged. */
+bool
+journal_active (void)
+{
+  return active;
+}
+
+/* Opens a handle. Every sector logged until the matching
+   journal_end() ends up in the same transaction. Handles may
+   nest; the outermost one reserves room for JOURNAL_HANDLE_MAX
+   sectors, waiting for the running transaction to commit if it
+   has too little left. A handle that logs more than that goes on
+   in room nobody reserved, at worst the JOURNAL_SPARE sectors
+   kept free for it. It must not be opened while holding a lock
+   that an open handle might wait for. */
+void
+journal_begin (void)
+{
+  struct thread *t = thread_current ();
+
+  if (!active || t->journal_depth++ > 0)
+    return;
+
+  lock_acquire (&journal_lock);
+  while (trans_cnt + reserved + JOURNAL_HANDLE_MAX > JOURNAL_TRANS_MAX)
+    {
+      if (handle_cnt == 0)
+        commit ();
+      else
+        {
+          commit_wanted = true;
+          cond_wait (&journal_committed, &journal_lock);
+        }
+    }
+  handle_cnt++;
+  reserved += JOURNAL_HANDLE_MAX;
+  t->journal_credits = JOURNAL_HANDLE_MAX;
+  lock_release (&journal_lock);
+}
+
+/* Closes a handle opened by journal_begin(). The last handle to
+   close commits the running transaction if it has grown large
+   or someone is waiting for it. */
+void
+journal_end (void)
+{
+  struct thread *t = thread_current ();
+
+  if (!active)
+    return;
+  ASSERT (t->journal_depth > 0);
+  if (--t->journal_depth > 0)
+    return;
+
+  lock_acquire (&journal_lock);
+  ASSERT (handle_cnt > 0);
+  reserved -= t->journal_credits;
+  t->journal_credits = 0;
+  if (--handle_cnt == 0
+      && (commit_wanted || trans_cnt >= JOURNAL_COMMIT_CNT))
+    commit ();
+  lock_release (&journal_lock);
+}
+
+/* Writes BLOCK_SECTOR_SIZE bytes from BUFFER to SECTOR as part of
+   the running transaction. */
+void
+journal_write (block_sector_t sector, const void *buffer)
+{
+  journal_write_at (sector, buffer, 0, BLOCK_SECTOR_SIZE);
+}
+
+/* Writes SIZE bytes from BUFFER to SECTOR, starting OFS bytes into
+   the sector, as part of the running transaction. The sector is
+   only written back once the transaction has committed.
+   Caller must have a handle open. */
+void
+journal_write_at (block_sector_t sector, const void *buffer,
+                  off_t ofs, off_t size)
+{
+  struct thread *t = thread_current ();
+
+  if (!active)
+    {
+      cache_write_at (sector, buffer, ofs, size);
+      return;
+    }
+
+  ASSERT (t->journal_depth > 0);
+  lock_acquire (&journal_lock);
+  if (trans_add (sector))
+    {
+      if (t->journal_credits > 0)
+        {
+          t->journal_credits--;
+          reserved--;
+        }
+      else if (trans_cnt + reserved > JOURNAL_TRANS_MAX)
+        {
+          /* The handle has outgrown its reservation and the room
+             nobody reserved. It is eating into the spare, so the
+             transaction commits as soon as every handle closes. */
+          commit_wanted = true;
+        }
+    }
+  cache_write_logged (sector, buffer, ofs, size);
+  lock_release (&journal_lock);
+}
+
+/* Returns true if the log may hold an image of SECTOR. */
+bool
+journal_holds (block_sector_t sector)
+{
+  if (!active)
+    return false;
+
+  lock_acquire (&journal_lock);
+  bool holds = bitmap_test (in_log, sector);
+  lock_release (&journal_lock);
+  return holds;
+}
+
+/* Commits the running transaction, waiting for the handles open
+   in it to close first. */
+void
+journal_commit (void)
+{
+  if (!active)
+    return;
+
+  lock_acquire (&journal_lock);
+  if (trans_cnt > 0)
+    {
+      uint32_t target = seq;
+      if (handle_cnt == 0)
+        commit ();
+      else
+        {
+          commit_wanted = true;
+          while (seq == target)
+            cond_wait (&journal_committed, &journal_lock);
+        }
+    }
+  lock_release (&journal_lock);
+}
+
+/* HELPERS */
+
+/* Writes the sectors of every committed transaction in the log to
+   where they belong, then empties the log. Runs before anything
+   else reads the file system. */
+static void
+replay (void)
+{
+  static struct journal_commit_block done;
+  struct journal_desc *desc = &staged.desc;
+  uint32_t pos = 0;
+  uint32_t s = header.seq;
+
+  while (pos + 2 <= header.size)
+    {
+      block_read (fs_device, header.start + pos, desc);
+      if (desc->magic != DESC_MAGIC || desc->seq != s
+          || desc->cnt > TRANS_CAP
+          || pos + desc->cnt + 2 > header.size)
+        break;
+      block_read (fs_device, header.start + pos + 1 + desc->cnt, &done);
+      if (done.magic != COMMIT_MAGIC || done.seq != s)
+        break;
+
+      block_read_multiple (fs_device, header.start + pos + 1, desc->cnt,
+                           staged.images);
+      for (uint32_t i = 0; i < desc->cnt; i++)
+        cache_write (desc->sectors[i], staged.images[i]);
+      pos += desc->cnt + 2;
+      s++;
+    }
+
+  /* The replayed sectors must be home before the log forgets
+     them. */
+  cache_flush ();
+  reset_log (s);
+}
+
+/* Writes the running transaction to the log, then lets its
+   sectors be written back. Checkpoints if the log has no room
+   left for another transaction.
+   Caller must hold journal_lock. */
+static void
+commit (void)
+{
+  static struct journal_commit_block done;
+  struct journal_desc *desc = &staged.desc;
+
+  commit_wanted = false;
+  if (trans_cnt == 0)
+    return;
+
+  memset (desc, 0, sizeof *desc);
+  desc->magic = DESC_MAGIC;
+  desc->seq = seq;
+  desc->cnt = trans_cnt;
+  memcpy (desc->sectors, trans, trans_cnt * sizeof *trans);
+
+  /* Logged sectors cannot be evicted, so they are all cached. */
+  for (size_t i = 0; i < trans_cnt; i++)
+    cache_read (trans[i], staged.images[i]);
+  block_write_multiple (fs_device, header.start + head, trans_cnt + 1,
+                        &staged);
+
+  memset (&done, 0, sizeof done);
+  done.magic = COMMIT_MAGIC;
+  done.seq = seq;
+  block_write (fs_device, header.start + head + 1 + trans_cnt, &done);
+
+  for (size_t i = 0; i < trans_cnt; i++)
+    cache_unlog (trans[i]);
+
+  head += trans_cnt + 2;
+  seq++;
+  trans_cnt = 0;
+  cond_broadcast (&journal_committed, &journal_lock);
+
+  if (head + TRANS_CAP + 2 > header.size)
+    checkpoint ();
+}
+
+/* Writes every committed sector back to where it belongs and
+   empties the log. Nothing is logged at the time.
+   Caller must hold journal_lock. */
+static void
+checkpoint (void)
+{
+  ASSERT (trans_cnt == 0);
+  cache_write_dirty ();
+  reset_log (seq);
+}
+
+/* Empties the log. The next transaction, numbered S, goes at its
+   start. */
+static void
+reset_log (uint32_t s)
+{
+  header.seq = s;
+  block_write (fs_device, JOURNAL_SECTOR, &header);
+  head = 0;
+  seq = s;
+  bitmap_set_all (in_log, false);
+}
+
+/* Adds SECTOR to the running transaction.
+   Returns true if it was not part of it yet.
+   Caller must hold journal_lock. */
+static bool
+trans_add (block_sector_t sector)
+{
+  for (size_t i = 0; i < trans_cnt; i++)
+    if (trans[i] == sector)
+      return false;
+  ASSERT (trans_cnt < TRANS_CAP);
+
+  trans[trans_cnt++] = sector;
+  bitmap_mark (in_log, sector);
+  return true;
+}
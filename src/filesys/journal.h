@@ -0,0 +1,45 @@
+#ifndef FILESYS_JOURNAL_H
+#define FILESYS_JOURNAL_H
+
+#include <stdbool.h>
+#include "devices/block.h"
+#include "filesys/cache.h"
+#include "filesys/off_t.h"
+
+/* Sectors in the log region, allocated when formatting. */
+#define JOURNAL_SIZE 128
+
+/* Most sectors the handles of one transaction reserve between
+   them. Logged sectors stay in the buffer cache until they are
+   committed, so this is kept well below CACHE_SIZE. */
+#define JOURNAL_TRANS_MAX (CACHE_SIZE / 2)
+
+/* Room a transaction keeps beyond JOURNAL_TRANS_MAX for handles
+   that log more sectors than they reserved. */
+#define JOURNAL_SPARE (JOURNAL_TRANS_MAX / 4)
+
+/* Once a transaction has logged this many sectors it is committed
+   as soon as no handle is open. */
+#define JOURNAL_COMMIT_CNT (JOURNAL_TRANS_MAX / 2)
+
+/* Most sectors one operation is expected to log. A thread's
+   outermost handle reserves this much room in the running
+   transaction, so that the transaction never has to commit while
+   it is open. Operations that could log more split themselves
+   over several handles. */
+#define JOURNAL_HANDLE_MAX (JOURNAL_TRANS_MAX / 2)
+
+void journal_init (void);
+void journal_create (void);
+void journal_open (void);
+void journal_close (void);
+bool journal_active (void);
+
+void journal_begin (void);
+void journal_end (void);
+void journal_write (block_sector_t, const void *);
+void journal_write_at (block_sector_t, const void *, off_t ofs, off_t size);
+bool journal_holds (block_sector_t);
+void journal_commit (void);
+
+#endif /* filesys/journal.h */
@@ -28,7 +28,11 @@ enum
     SYS_MKDIR,                  /* Create a directory. */
     SYS_READDIR,                /* Reads a directory entry. */
     SYS_ISDIR,                  /* Tests if a fd represents a directory. */
-    SYS_INUMBER                 /* Returns the inode number for a fd. */
+    SYS_INUMBER,                /* Returns the inode number for a fd. */
+
+    /* Durability. */
+    SYS_FSYNC,                  /* Writes out a file's data and metadata. */
+    SYS_SYNC                    /* Writes out everything pending. */
   };
 
 #endif /* lib/syscall-nr.h */
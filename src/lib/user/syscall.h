@@ -45,4 +45,8 @@ bool readdir (int fd, char name[READDIR_MAX_LEN + 1]);
 bool isdir (int fd);
 int inumber (int fd);
 
+/* Durability. */
+bool fsync (int fd);
+void sync (void);
+
 #endif /* lib/user/syscall.h */
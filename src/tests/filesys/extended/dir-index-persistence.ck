@@ -0,0 +1,8 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+my ($fs);
+$fs->{'x'}{"file$_"} = [''] foreach grep ($_ % 3 || $_ == 0, 0...299);
+check_archive ($fs);
+pass;
@@ -0,0 +1,74 @@
+/* Fills a directory with enough files that its name index is
+   rebuilt larger several times, to more slots than one journal
+   handle could log at once, removes every third one and creates
+   one of those again, then checks that each name is found, or
+   not, as it should be, and that readdir() lists exactly the
+   files left. */
+
+#include <stdio.h>
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define FILE_CNT 300
+
+/* Returns true if file I should exist once the test is done. */
+static bool
+kept (int i) 
+{
+  return i % 3 != 0 || i == 0;
+}
+
+void
+test_main (void) 
+{
+  char name[READDIR_MAX_LEN + 1];
+  char file_name[32];
+  int fd, cnt, i;
+
+  CHECK (mkdir ("/x"), "mkdir \"/x\"");
+  for (i = 0; i < FILE_CNT; i++) 
+    {
+      snprintf (file_name, sizeof file_name, "/x/file%d", i);
+      if (!create (file_name, 0))
+        fail ("create \"%s\"", file_name);
+    }
+  msg ("created \"/x/file0\" through \"/x/file%d\"", FILE_CNT - 1);
+
+  for (i = 0; i < FILE_CNT; i += 3) 
+    {
+      snprintf (file_name, sizeof file_name, "/x/file%d", i);
+      if (!remove (file_name))
+        fail ("remove \"%s\"", file_name);
+    }
+  msg ("removed every third file");
+  CHECK (create ("/x/file0", 0), "create \"/x/file0\" again");
+
+  for (i = 0; i < FILE_CNT; i++) 
+    {
+      snprintf (file_name, sizeof file_name, "/x/file%d", i);
+      fd = open (file_name);
+      if (kept (i) && fd < 2)
+        fail ("open \"%s\" failed", file_name);
+      if (!kept (i) && fd != -1)
+        fail ("open \"%s\" succeeded after it was removed", file_name);
+      if (fd > 1)
+        close (fd);
+    }
+  msg ("looked up every name");
+
+  CHECK ((fd = open ("/x")) > 1, "open \"/x\"");
+  cnt = 0;
+  while (readdir (fd, name))
+    if (!memcmp (name, "file", 4))
+      cnt++;
+  for (i = 0; i < FILE_CNT; i++)
+    if (kept (i))
+      cnt--;
+  if (cnt != 0)
+    fail ("readdir listed %d files more than expected", cnt);
+  msg ("readdir listed every file left");
+  msg ("close \"/x\"");
+  close (fd);
+}
@@ -0,0 +1,17 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(dir-index) begin
+(dir-index) mkdir "/x"
+(dir-index) created "/x/file0" through "/x/file299"
+(dir-index) removed every third file
+(dir-index) create "/x/file0" again
+(dir-index) looked up every name
+(dir-index) open "/x"
+(dir-index) readdir listed every file left
+(dir-index) close "/x"
+(dir-index) end
+EOF
+pass;
@@ -0,0 +1,12 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+use tests::random;
+my ($data) = random_bytes (100);
+$data .= "\0" x (30000 - 100);
+$data .= random_bytes (512);
+$data .= "\0" x (39900 - 30512);
+$data .= random_bytes (100);
+check_archive ({"testfile" => [$data]});
+pass;
@@ -0,0 +1,35 @@
+/* Writes a file in three pieces with whole sectors skipped over
+   between them, and checks that what was skipped reads back as
+   zeros. */
+
+#include <random.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+static char buf[40000];
+
+static void
+write_at (int fd, size_t ofs, size_t size) 
+{
+  random_bytes (buf + ofs, size);
+  seek (fd, ofs);
+  CHECK (write (fd, buf + ofs, size) == (int) size,
+         "write %zu bytes at offset %zu", size, ofs);
+}
+
+void
+test_main (void) 
+{
+  const char *file_name = "testfile";
+  int fd;
+
+  CHECK (create (file_name, 0), "create \"%s\"", file_name);
+  CHECK ((fd = open (file_name)) > 1, "open \"%s\"", file_name);
+  write_at (fd, 0, 100);
+  write_at (fd, 30000, 512);
+  write_at (fd, 39900, 100);
+  msg ("close \"%s\"", file_name);
+  close (fd);
+  check_file (file_name, buf, sizeof buf);
+}
@@ -0,0 +1,18 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(grow-holes) begin
+(grow-holes) create "testfile"
+(grow-holes) open "testfile"
+(grow-holes) write 100 bytes at offset 0
+(grow-holes) write 512 bytes at offset 30000
+(grow-holes) write 100 bytes at offset 39900
+(grow-holes) close "testfile"
+(grow-holes) open "testfile" for verification
+(grow-holes) verified contents of "testfile"
+(grow-holes) close "testfile"
+(grow-holes) end
+EOF
+pass;
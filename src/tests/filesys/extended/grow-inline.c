@@ -0,0 +1,35 @@
+/* Grows a file small enough to be kept inside its inode up to
+   the most that fits there, 464 bytes, then writes across that
+   limit so that its data has to move out into sectors of its
+   own. The contents are checked after every step. */
+
+#include <random.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+static char buf[1000];
+
+static void
+grow (int fd, const char *file_name, size_t ofs, size_t size) 
+{
+  CHECK (write (fd, buf + ofs, size) == (int) size,
+         "write bytes %zu to %zu", ofs, ofs + size);
+  check_file (file_name, buf, ofs + size);
+}
+
+void
+test_main (void) 
+{
+  const char *file_name = "small";
+  int fd;
+
+  random_bytes (buf, sizeof buf);
+  CHECK (create (file_name, 0), "create \"%s\"", file_name);
+  CHECK ((fd = open (file_name)) > 1, "open \"%s\"", file_name);
+  grow (fd, file_name, 0, 400);
+  grow (fd, file_name, 400, 64);
+  grow (fd, file_name, 464, 536);
+  msg ("close \"%s\"", file_name);
+  close (fd);
+}
@@ -0,0 +1,18 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(sync-fsync) begin
+(sync-fsync) create "synced"
+(sync-fsync) open "synced"
+(sync-fsync) write "synced"
+(sync-fsync) fsync "synced"
+(sync-fsync) close "synced"
+(sync-fsync) sync
+(sync-fsync) open "synced" for verification
+(sync-fsync) verified contents of "synced"
+(sync-fsync) close "synced"
+(sync-fsync) end
+EOF
+pass;
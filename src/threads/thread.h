@@ -132,6 +132,10 @@ struct thread
 
    struct dir *cwd;                   /* Current-working directory. NULL implies root directory */
 
+   /* Owned by filesys/journal.c. */
+   int journal_depth;                 /* Journal handles open, nested ones included. */
+   size_t journal_credits;            /* Sectors the outermost handle may still log. */
+
    /* Owned by thread.c. */
    unsigned magic;                     /* Detects stack overflow. */
 };
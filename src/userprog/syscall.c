@@ -42,21 +42,18 @@ bool readdir (int fd, char *name);
 bool isDir (int fd);
 int iNumber (int fd);
 
+bool fsync (int fd);
+void sync (void);
+
 // Helper prototypes
 void* get_stack_arg (void *esp, int offset);
 void exit_if_null (void *ptr);
 void validate_user_address (void *addr);
 
-// Synchronization variables
-struct lock filesys_lock;
-
 void
 syscall_init (void) 
 {
   intr_register_int (0x30, 3, INTR_ON, syscall_handler, "syscall");
-  
-  // Initialize locks
-  lock_init(&filesys_lock);
 }
 
 static void
@@ -93,9 +90,7 @@ syscall_handler (struct intr_frame *f)
 
       void *file_name = *exec_file_addr;
 
-      lock_acquire(&filesys_lock);
       f->eax = exec (file_name);
-      lock_release(&filesys_lock);
       break;
     }
 
@@ -119,9 +114,7 @@ syscall_handler (struct intr_frame *f)
       validate_user_address (file_name);
       validate_user_address (file_size);
 
-      lock_acquire(&filesys_lock);
       f->eax = create(file_name, *file_size);
-      lock_release(&filesys_lock);
       break;
     }
       
@@ -133,9 +126,7 @@ syscall_handler (struct intr_frame *f)
       void *file_name = *string_buffer_addr;
       validate_user_address (file_name);
 
-      lock_acquire (&filesys_lock);
       f->eax = remove (file_name);
-      lock_release (&filesys_lock);
       break;
     }
       
@@ -300,6 +291,21 @@ syscall_handler (struct intr_frame *f)
       break;
     }
 
+    case SYS_FSYNC:
+    {
+      int *fd_addr = f->esp + 4;
+      validate_user_address (fd_addr);
+
+      f->eax = fsync (*fd_addr);
+      break;
+    }
+
+    case SYS_SYNC:
+    {
+      sync ();
+      break;
+    }
+
     // Unhandled case
     default:
       break;
@@ -436,18 +442,13 @@ open (const char *file_name)
   if (strcmp(file_name, empty) == 0)
     return -1;
 
-  lock_acquire(&filesys_lock);
-
   // Keep track of last segment, i.e. name of file/directory to open
   char t[NAME_MAX + 1];
 
   struct dir *result = resolve_path (file_name, thread_cwd (), t, false);
   
   if(result == NULL)
-  {
-    lock_release(&filesys_lock);
     return -1;
-  }
 
   struct dir *result_parent = dir_get_parent (result);
 
@@ -465,8 +466,6 @@ open (const char *file_name)
   // if(is_dir(file_get_inode(file)))
   //   print_fs (file, 1);
 
-  lock_release(&filesys_lock);
-
   if (file == NULL)
     return -1;
 
@@ -515,9 +514,7 @@ read (int fd, void *buffer, unsigned size)
     struct file *file = thread_get_file_by_fd (fd);
     exit_if_null (file);
 
-    lock_acquire(&filesys_lock);
     off_t bytes_read = file_read (file, buffer, size);
-    lock_release(&filesys_lock);
     return bytes_read;
   }
 
@@ -544,14 +541,10 @@ write (int fd, const void *buffer, unsigned size)
     if (is_dir (file_get_inode (file)))
       exit (-1);
 
-    // Make sure we're the only one 
-    // writing to this file.
-    lock_acquire (&filesys_lock);
-    
+    // The inode's own lock keeps other writers out.
     // printf(">> Writing to fd %d with size %d to file %p at offset %d\n", fd, size, file, file_tell(file));
 
     new_size = file_write (file, buffer, size);
-    lock_release (&filesys_lock);
 
     return new_size;
   }
@@ -563,9 +556,7 @@ seek (int fd, unsigned position)
   struct file* file = thread_get_file_by_fd (fd);
   exit_if_null (file);
 
-  lock_acquire (&filesys_lock);
   file_seek (file, position);
-  lock_release (&filesys_lock);
 }
 
 unsigned 
@@ -646,3 +637,19 @@ iNumber (int fd)
 
   return inode_get_inumber (file_get_inode (file));
 }
+
+bool
+fsync (int fd)
+{
+  struct file* file = thread_get_file_by_fd (fd);
+  exit_if_null (file);
+
+  filesys_fsync (file_get_inode (file));
+  return true;
+}
+
+void
+sync (void)
+{
+  filesys_sync ();
+}
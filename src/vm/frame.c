@@ -1,4 +1,5 @@
 #include "frame.h"
+#include <string.h>
 #include "threads/malloc.h"
 #include "threads/palloc.h"
 #include "threads/thread.h"
@@ -31,7 +32,9 @@ ft_allocate (enum palloc_flags flags)
     struct frame_table_entry *fte = malloc (sizeof (struct frame_table_entry));
     fte->owner = thread_current ();
     fte->page = page;   // Make sure it points to the base of the page
-    fte->pinned = false;
+    fte->pinned = true;    // Until the caller links it to a page
+    fte->swap_slot = -1;
+    fte->zero = false;
 
     if (!lock_held_by_current_thread (&frame_table_lock))
       lock_acquire (&frame_table_lock);
@@ -40,49 +43,55 @@ ft_allocate (enum palloc_flags flags)
     list_push_back (&frame_table_list, &fte->elem);
     lock_release (&frame_table_lock);
   }
-  // Page not returned, we must swap and try again. 
+  // Page not returned, we must swap out another page and take its frame. 
   else
   {
     // Step 1 - Select candidate page in frame table based on LRU algorithm.
     struct frame_table_entry *fte = ft_find_evict_page ();
     struct sup_page_table_entry *sup = fte->spte;
 
-    // Step 2 - Write contents of candidate page into "swap" file
-    sup->swap_index = swap_allocate (fte->page);
+    // Step 2 - Start writing contents of candidate page into "swap" file,
+    // once any write still running from the frame's previous eviction is done
+    if (fte->swap_slot >= 0)
+      swap_write_wait (fte->swap_slot);
+    fte->swap_slot = swap_allocate_start (fte->page, &fte->swap_io);
+    sup->swap_index = fte->swap_slot;
     sup->in_swap = true;
 
     // Step 2.1 - Make sure to call pagedir_clear_page to free that memory from the user pool.
     pagedir_clear_page(fte->owner->pagedir, fte->spte->upage);
-    ft_free_fte (fte);
 
-    // Step 3: Allocate a new page (like shown above) and push into frame list
-    page = palloc_get_page (flags);
-
-    if (page != NULL)
-    {
-      // Allocate a new frame table entry
-      struct frame_table_entry *fte = malloc (sizeof (struct frame_table_entry));
-
-      fte->owner = curr;
-      fte->page = page;   // Make sure it points to the base of the page
-      fte->pinned = false;
-
-      if (!lock_held_by_current_thread (&frame_table_lock))
-        lock_acquire (&frame_table_lock);
-
-      // Add the frame to the list and release lock
-      list_push_back (&frame_table_list, &fte->elem);
-      lock_release (&frame_table_lock);
-    }
-    else
-    {
-      PANIC("Failed to free a page frame.\n");
-    }
+    // Step 3: Hand the frame straight to the current thread, still pinned
+    // until the caller links it to a page. The write carries on meanwhile;
+    // ft_wait() waits for it before the frame is written to.
+    fte->owner = curr;
+    fte->spte = NULL;
+    fte->zero = (flags & PAL_ZERO) != 0;
+    page = fte->page;
   }
 
   return page;
 }
 
+/* Waits until the page FTE's frame was taken from has been
+   written to swap, then zeros the frame if its caller asked for a
+   zeroed one. Must be called before the frame returned by
+   ft_allocate() is written to or mapped. */
+void
+ft_wait (struct frame_table_entry *fte)
+{
+  if (fte->swap_slot >= 0)
+  {
+    swap_write_wait (fte->swap_slot);
+    fte->swap_slot = -1;
+  }
+  if (fte->zero)
+  {
+    memset (fte->page, 0, PGSIZE);
+    fte->zero = false;
+  }
+}
+
 void 
 ft_free_page (void *page)
 {
@@ -107,6 +116,7 @@ ft_free_page (void *page)
         lock_acquire(&frame_table_lock);
     }
 
+    ft_wait (fte);
     list_remove (&fte->elem);
     palloc_free_page (fte->page);
     free (fte);
@@ -181,6 +191,7 @@ ft_clear_thread_pages()
     
     if(fte->owner == curr)
     {
+      ft_wait (fte);
       list_remove(&fte->elem);
       palloc_free_page(fte->page);
 
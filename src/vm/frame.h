@@ -2,6 +2,7 @@
 #define VM_FRAME_H
 
 #include "lib/kernel/list.h"
+#include "devices/block.h"
 #include "threads/palloc.h"
 #include "vm/page.h"
 
@@ -26,10 +27,16 @@ struct frame_table_entry
     bool pinned;            // Used for sync access. Will not be a candidate for swapping if true.
 
     struct sup_page_table_entry *spte; 
+
+    // Set when the frame was taken from another page
+    int swap_slot;                  // Slot its old page is still being written to, or -1.
+    struct block_request swap_io;   // That write.
+    bool zero;                      // Must be zeroed once the write is done.
 };
 
 void ft_init ();
 void *ft_allocate (enum palloc_flags flags);
+void ft_wait (struct frame_table_entry *fte);
 void ft_free_page (void *page);
 void ft_clear_thread_pages();
 struct frame_table_entry *ft_find_page(void *page);
@@ -59,13 +59,12 @@ spt_load_from_file (struct sup_page_table_entry *spte)
     uint8_t *kpage = ft_allocate(PAL_USER | PAL_ZERO);
     struct frame_table_entry *fte = ft_find_page(kpage);
 
-    fte->pinned = true;
-
     if (kpage == NULL)
     {
         ft_free_page(kpage);
         return false;
     }
+    ft_wait(fte);
 
     /* Write the code into the frame */
     if (spte->page_read_bytes != 0)
@@ -104,7 +103,7 @@ swap_into_memory(struct sup_page_table_entry *spte)
   // Step 1: Get frame table entry
   uint8_t *frame = ft_allocate (PAL_USER | PAL_ZERO);
   struct frame_table_entry *fte = ft_find_page (frame);
-  fte->pinned = true;
+  ft_wait (fte);
 
   // Step 2: Install the page
   if(!install_page (spte->upage, frame, true))
@@ -154,6 +153,7 @@ spt_grow_stack_by_one (void *vaddr)
     struct frame_table_entry *fte = ft_find_page (frame_base);
     fte->spte = spte;
     fte->owner = spte->owner;
+    ft_wait (fte);
 
     bool success = install_page (upage_base, frame_base, spte->writable);
 
@@ -166,6 +166,7 @@ spt_grow_stack_by_one (void *vaddr)
     }
     /* Add the spte to the thread's list */
     list_push_back(&spte->owner->sup_page_table, &spte->elem);
+    fte->pinned = false;
     return true;
 }
 
@@ -6,6 +6,10 @@
 
 static int swap_list[MAX_SWAP_ENTRIES];
 
+/* Write started by swap_allocate_start() that nobody has waited
+   for yet, for each slot. Protected by swap_modify_lock. */
+static struct block_request *swap_writes[MAX_SWAP_ENTRIES];
+
 void
 swap_init()
 {
@@ -17,10 +21,21 @@ swap_init()
 /* Write page at frame to swap and return the index where it is located */
 int
 swap_allocate(void *frame)
+{
+  struct block_request io;
+  int free_spot = swap_allocate_start (frame, &io);
+
+  swap_write_wait (free_spot);
+  return free_spot;
+}
+
+/* Like swap_allocate(), but only starts writing the page, with IO.
+   The caller may do other work meanwhile, and must call
+   swap_write_wait() before reusing the frame or IO. */
+int
+swap_allocate_start(void *frame, struct block_request *io)
 {
   int free_spot;
-  int next_page_pos;
-  int next_block_pos;
   
   if(!lock_held_by_current_thread(&swap_modify_lock))
     lock_acquire (&swap_modify_lock);
@@ -32,23 +47,40 @@ swap_allocate(void *frame)
   swap_list[free_spot] = 1;
 
   // Since block size is 512 bytes and page is 4KB, 
-  // we need to iterate multiple times in order to write
-  // all the data to disk.
-  for(int i = 0; i < BLOCKS_IN_SWAP; i++)
-  {
-    // Where the next page data & block sector is
-    next_page_pos = (uint8_t *) frame + (i * BLOCK_SECTOR_SIZE);
-    next_block_pos = free_spot*BLOCKS_IN_SWAP + i;
-
-    // Write page data to a given block
-    block_write(global_swap, next_block_pos, next_page_pos);
-  }
+  // the page takes several consecutive sectors, written
+  // with a single request.
+  io->write = true;
+  io->sector = free_spot*BLOCKS_IN_SWAP;
+  io->cnt = BLOCKS_IN_SWAP;
+  io->buffer = frame;
+  io->done = NULL;
+  io->aux = NULL;
+  block_submit(global_swap, io);
+  swap_writes[free_spot] = io;
 
   lock_release (&swap_modify_lock);
 
   return free_spot;
 }
 
+/* Waits until the write swap_allocate_start() started into slot
+   INDEX, if any, has reached the disk. Whoever calls this first
+   does the waiting, later callers return right away. */
+void
+swap_write_wait(int index)
+{
+  if(!lock_held_by_current_thread(&swap_modify_lock))
+    lock_acquire (&swap_modify_lock);
+
+  if (swap_writes[index] != NULL)
+  {
+    block_wait (swap_writes[index]);
+    swap_writes[index] = NULL;
+  }
+
+  lock_release (&swap_modify_lock);
+}
+
 /* Read swap data into page "frame" at given index. 
    Index should have been obtained by call to swap_allocate(). */
 void
@@ -61,11 +93,15 @@ swap_read(void *frame, int index)
   if(!swap_list[index])
     return NULL;
 
-  for(int i = 0; i < BLOCKS_IN_SWAP; i++)
+  // The page may still be on its way out
+  if (swap_writes[index] != NULL)
   {
-    block_read(global_swap, index*BLOCKS_IN_SWAP + i, (uint8_t *) frame + (i * BLOCK_SECTOR_SIZE));
+    block_wait (swap_writes[index]);
+    swap_writes[index] = NULL;
   }
 
+  block_read_multiple(global_swap, index*BLOCKS_IN_SWAP, BLOCKS_IN_SWAP, frame);
+
   lock_release (&swap_modify_lock);
 }
 
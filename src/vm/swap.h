@@ -19,6 +19,8 @@ struct lock swap_modify_lock;
 void swap_init();
 
 int swap_allocate(void *frame);
+int swap_allocate_start(void *frame, struct block_request *io);
+void swap_write_wait(int index);
 void swap_read(void *frame, int index);
 void swap_free(int index);
 void swap_print_status();